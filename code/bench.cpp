@@ -0,0 +1,146 @@
+/**
+ *  @filename   :   bench.cpp
+ *  @brief      :   Times the optimized kernels and parsers against reference.cpp
+ *
+ *      make bench
+ *  Objects are built with upNext's CC_FLAGS: run it on the Pi, with the same build, for numbers
+ *  that mean something.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "event.h"
+#include "frameops.h"
+#include "reference.h"
+#include "../lib/json.hpp"
+
+// Keeps results alive, so the compiler can't drop the work
+static volatile unsigned long sink;
+
+// The 400x300 display's frame: 50 bytes a row
+#define ROW_BYTES 50
+#define HEIGHT 300
+
+static void BenchDiffFrames(void) {
+  static unsigned char a[ROW_BYTES * HEIGHT];
+  static unsigned char b[ROW_BYTES * HEIGHT];
+  for (unsigned int i = 0; i < sizeof a; i++) {
+    a[i] = b[i] = i * 7;
+  }
+  std::vector<DirtySpan> spans;
+  spans.reserve(ROW_BYTES * HEIGHT);
+
+  const char *cases[] = { "unchanged", "clock-sized change", "every row changed" };
+  for (int c = 0; c < 3; c++) {
+    if (c == 1) {
+      // The clock: 13 rows, a few bytes each, in the top right corner
+      for (int row = 10; row < 23; row++) {
+        b[row * ROW_BYTES + 40 + row % 10] ^= 0x5A;
+      }
+    } else if (c == 2) {
+      for (int row = 0; row < HEIGHT; row++) {
+        b[row * ROW_BYTES + row % ROW_BYTES] ^= 0x18;
+      }
+    }
+    const int runs = 5000;
+    double start = MonotonicUs();
+    for (int n = 0; n < runs; n++) {
+      sink += DiffFrames(a, b, ROW_BYTES, ROW_BYTES, HEIGHT, 3, spans);
+    }
+    double kernel_us = (MonotonicUs() - start) / runs;
+    start = MonotonicUs();
+    for (int n = 0; n < runs; n++) {
+      sink += DiffFramesBytewise(a, b, ROW_BYTES, ROW_BYTES, HEIGHT, 3, spans);
+    }
+    double bytewise_us = (MonotonicUs() - start) / runs;
+    printf("DiffFrames, %s: %.2f us, byte loop %.2f us\n", cases[c], kernel_us, bytewise_us);
+  }
+}
+
+static void BenchConvertCairoA1ToPanel(void) {
+  // Cairo pads the 50 byte rows to a 52 byte stride
+  static unsigned char cairo[52 * HEIGHT];
+  static unsigned char panel[ROW_BYTES * HEIGHT];
+  for (unsigned int i = 0; i < sizeof cairo; i++) {
+    cairo[i] = i * 13;
+  }
+  void (*convert[])(const unsigned char *, unsigned char *, unsigned int) = {
+    ConvertCairoA1ToPanel, ConvertCairoA1ToPanelGeneric, ConvertCairoA1ToPanelBitwise
+  };
+  const char *names[] = { "ConvertCairoA1ToPanel", "table only", "bitwise" };
+  double us[3];
+  for (int c = 0; c < 3; c++) {
+    const int runs = c == 2 ? 20 : 2000;
+    double start = MonotonicUs();
+    for (int n = 0; n < runs; n++) {
+      for (int row = 0; row < HEIGHT; row++) {
+        convert[c](cairo + row * 52, panel + row * ROW_BYTES, ROW_BYTES);
+      }
+      sink += panel[n % sizeof panel];
+    }
+    us[c] = (MonotonicUs() - start) / runs;
+  }
+  printf("%s, 400x300 frame: %.2f us, %s %.2f us, %s %.2f us\n", names[0], us[0], names[1], us[1],
+      names[2], us[2]);
+}
+
+static void BenchParseEventTime(void) {
+  setenv("TZ", "Europe/Berlin", 1);
+  tzset();
+  const char *times[] = { "2026-10-18T09:00:00+02:00", "2026-10-18T15:30:00Z", "2026-10-18T10:00:00-07:00" };
+  const char *dates[] = { "2026-10-18", "2026-10-19" };
+  bool (*parse[])(const char *, size_t, bool, int64_t *) = { ParseEventTime, ParseEventTimeStrptime };
+  double ns[2][2];
+  for (int p = 0; p < 2; p++) {
+    for (int date = 0; date < 2; date++) {
+      const int runs = 300000;
+      double start = MonotonicUs();
+      for (int n = 0; n < runs; n++) {
+        const char *value = date ? dates[n % 2] : times[n % 3];
+        int64_t time = 0;
+        parse[p](value, strlen(value), date, &time);
+        sink += time;
+      }
+      ns[p][date] = (MonotonicUs() - start) * 1000 / runs;
+    }
+  }
+  printf("ParseEventTime, times: %.1f ns, strptime %.1f ns\n", ns[0][0], ns[1][0]);
+  printf("ParseEventTime, dates: %.1f ns, strptime and mktime %.1f ns\n", ns[0][1], ns[1][1]);
+}
+
+// Bytes on the wire and parse times of a busy day's event list, in full and with the fields=
+// projection (EVENT_LIST_FIELDS), with nlohmann::json and with ParseEventPage
+static void BenchEventListFields(void) {
+  const char *fixtures[] = { "events_full.json", "events_fields.json" };
+  for (int f = 0; f < 2; f++) {
+    std::string body = ReadFixture(fixtures[f]);
+    if (body.empty()) {
+      continue;
+    }
+    const int runs = 200;
+    double start = MonotonicUs();
+    for (int n = 0; n < runs; n++) {
+      sink += nlohmann::json::parse(body)["items"].size();
+    }
+    double json_us = (MonotonicUs() - start) / runs;
+    EventPage page;
+    start = MonotonicUs();
+    for (int n = 0; n < runs; n++) {
+      sink += ParseEventPage(body.data(), body.size(), page);
+    }
+    double page_us = (MonotonicUs() - start) / runs;
+    printf("%s: %zu bytes, %zu events, json::parse %.0f us, ParseEventPage %.0f us\n", fixtures[f],
+        body.size(), page.items.events.size(), json_us, page_us);
+  }
+}
+
+int main(void) {
+  BenchDiffFrames();
+  BenchConvertCairoA1ToPanel();
+  BenchParseEventTime();
+  BenchEventListFields();
+  return 0;
+}
@@ -24,10 +24,23 @@
  * THE SOFTWARE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
+#include <algorithm>    // std::min
 #include "epd4in2b.h"
 #include "epdif.h"
+#include "frameops.h"
+
+// Folds a new measurement into a running average, weighting it 1/4
+static void TrackAverage(uint32_t &average, uint64_t sample) {
+    if (average == 0) {
+        average = sample;
+    } else {
+        average = (uint32_t) (((uint64_t) average * 3 + sample) / 4);
+    }
+}
 
 Epd::~Epd() {
 };
@@ -39,6 +52,16 @@ Epd::Epd() {
     busy_pin = BUSY_PIN;
     width = EPD_WIDTH;
     height = EPD_HEIGHT;
+    resident_waveform = WAVEFORM_NONE;
+    resident_band = -1;
+    band = -1;
+    temperature = TEMPERATURE_UNKNOWN;
+    partial_mode = false;
+    color_mode = false;
+    old_plane_white = false;
+    memset(&timing, 0, sizeof timing);
+    frame_format = FRAME_FORMAT_PANEL;
+    frame_stride = EPD_WIDTH / 8;
 };
 
 int Epd::Init(void) {
@@ -68,7 +91,7 @@ if (IfInit() != 0) {
   //  SendData(0x0b);
 //	SendData(0x0F);  //300x400 Red mode, LUT from OTP
 	  //SendData(0x1F);  //300x400 B/W mode, LUT from OTP
-	  SendData(0x3F); //300x400 B/W mode, LUT set by register
+	  SendData(PANEL_SETTING_KW_REGISTER_LUT); //300x400 B/W mode, LUT set by register
 //	SendData(0x2F); //300x400 Red mode, LUT set by register
 
     SendCommand(PLL_CONTROL);
@@ -99,13 +122,62 @@ void Epd::SendData(unsigned char data) {
     SpiTransfer(data);
 }
 
+/**
+ *  @brief: sends a whole buffer of data, setting DC once and streaming it over SPI
+ */
+void Epd::SendDataBlock(const unsigned char* data, size_t len) {
+    DigitalWrite(dc_pin, HIGH);
+    uint64_t start = MonotonicUs();
+    SpiTransferBlock(data, len);
+    if (len >= TIMED_BLOCK_MIN_BYTES) {
+        TrackAverage(timing.spi_ns_per_byte, (MonotonicUs() - start) * 1000 / len);
+    }
+}
+
+/**
+ *  @brief: sends len copies of value as data, in blocks
+ */
+void Epd::SendDataFill(unsigned char value, size_t len) {
+    unsigned char block[256];
+    memset(block, value, sizeof block);
+    DigitalWrite(dc_pin, HIGH);
+    while (len > 0) {
+        size_t chunk = std::min(len, sizeof block);
+        SpiTransferBlock(block, chunk);
+        len -= chunk;
+    }
+}
+
 /**
  *  @brief: Wait until the busy_pin goes HIGH
  */
 void Epd::WaitUntilIdle(void) {
-    while(DigitalRead(busy_pin) == 0) {      //0: busy, 1: idle
-        DelayMs(1);
-    }      
+    if (WaitForLevel(busy_pin, HIGH, BUSY_TIMEOUT_MS) != 0) {      //0: busy, 1: idle
+        std::cout << "e-Paper still busy after " << BUSY_TIMEOUT_MS << "ms, giving up" << std::endl;
+    }
+}
+
+/**
+ *  @brief: Wait for a refresh that was just started to finish. BUSY takes a moment to
+ *          assert after DISPLAY_REFRESH, so wait for that edge before waiting for idle
+ */
+void Epd::WaitUntilRefreshed(void) {
+    uint64_t start = MonotonicUs();
+    WaitForLevel(busy_pin, LOW, REFRESH_START_TIMEOUT_MS);
+    WaitUntilIdle();
+    if (color_mode) {
+        TrackAverage(timing.color_refresh_us, MonotonicUs() - start);
+    } else if (resident_waveform != WAVEFORM_NONE) {
+        uint32_t *refresh_us = partial_mode ? timing.partial_refresh_us : timing.refresh_us;
+        TrackAverage(refresh_us[resident_waveform], MonotonicUs() - start);
+    }
+}
+
+/**
+ *  @brief: refresh and transfer durations measured so far, for callers that plan refreshes
+ */
+const EpdTiming& Epd::GetTiming(void) {
+    return timing;
 }
 
 /**
@@ -114,11 +186,23 @@ void Epd::WaitUntilIdle(void) {
  *          see Epd::Sleep();
  */
 void Epd::Reset(void) {
+    // The controller's registers, including the LUTs, don't survive a reset
+    resident_waveform = WAVEFORM_NONE;
     DigitalWrite(reset_pin, LOW);
     DelayMs(200);
     DigitalWrite(reset_pin, HIGH);
     DelayMs(200);   
 }
+/**
+ *  @brief: sets the layout of the full frame buffers passed to DisplayFrame and DisplayPartialFrame.
+ *          stride is the distance between rows, in bytes. Anything but panel format is converted
+ *          on the way out, so only the bytes actually sent are ever converted
+ */
+void Epd::SetFrameFormat(EpdFrameFormat format, unsigned int stride) {
+    frame_format = format;
+    frame_stride = stride;
+}
+
 /**
  *  @brief: transmit partial data to the SRAM.  The final parameter chooses between dtm=1 and dtm=2
  */
@@ -137,40 +221,23 @@ void Epd::SetPartialWindow(const unsigned char* buffer_black, int x, int y, int
     SendData(0x00);         // Gates scan both inside and outside of the partial window. (bvz) 
   //  DelayMs(2);
     SendCommand((dtm == 1) ? DATA_START_TRANSMISSION_1 : DATA_START_TRANSMISSION_2);
+    if (dtm == 1) {
+        old_plane_white = false;
+    }
     if (buffer_black != NULL) {
-        for(int i = 0; i < w  / 8 * l; i++) {
-            SendData(buffer_black[i]);  
-        }  
+        SendDataBlock(buffer_black, w / 8 * l);
     } else {
-        for(int i = 0; i < w  / 8 * l; i++) {
-            SendData(0x00);  
-        }  
+        SendDataFill(0x00, w / 8 * l);
     }
  //   DelayMs(2);
     SendCommand(PARTIAL_OUT);  
 }
 
 /**
- *  Note: frame_buffer is the frame buffer for the _full_ screen, this function
- *  only renders the portion of it within the partial frame
- *  @brief: Renders data to a partial section of the screen
+ *  @brief: sets the partial window to x..x+w-1, y..y+l-1, x and w multiples of 8
  */
-void Epd::DisplayPartialFrame(const unsigned char* frame_buffer, int x, int y, int w, int l) {
-  // This function has undergone quite a bit of tuning to do partial refreshes with minimal artifacts
-  // on the 4.2 tri-color epaper display, namely:
-  // - use a custom LUT (LutBvz): the default LUT not only does a lot of unnecessary blinking, it
-  //   also creates noticible fading artifacts on pixels _outside_ the partial frame window
-  // - only scan gates inside the partial window: this reduces the impact on pixels outside the partial window
-  // - sending the data and refresh twice: with the custom LUT, the pixels don't always "stick" when going from one state to the next, this helps
-  // Prep
-  SetLutBvz();
-  //SetLut();
-  SendCommand(PARTIAL_IN);
+void Epd::SendPartialWindow(int x, int y, int w, int l) {
   SendCommand(PARTIAL_WINDOW);
-
-  // x should be the multiple of 8, the last 3 bit will always be ignored
-  x = x & 0xFF8;
-
   //Horizontal start (first bit 8, then bits 7-3)
   SendData(x >> 8);
   SendData(x & 0x0FF);     
@@ -186,155 +253,422 @@ void Epd::DisplayPartialFrame(const unsigned char* frame_buffer, int x, int y, i
   SendData((y + l - 1) & 0xff);
   //PTScan
   SendData(0x00);         // Gates scan only inside the partial window.
+}
+
+/**
+ *  Note: frame_buffer is the frame buffer for the _full_ screen, this function
+ *  only renders the portion of it within the partial frame.
+ *  waveform and passes default to the fast custom LUT, sent twice; a cleanup refresh of a
+ *  ghosted region uses WAVEFORM_CLEANUP once instead. Never WAVEFORM_FULL: see the fading below
+ *  @brief: Renders data to a partial section of the screen
+ */
+void Epd::DisplayPartialFrame(const unsigned char* frame_buffer, int x, int y, int w, int l,
+                              EpdWaveform waveform, int passes) {
+  // This function has undergone quite a bit of tuning to do partial refreshes with minimal artifacts
+  // on the 4.2 tri-color epaper display, namely:
+  // - use a custom LUT (LutBvz): the default LUT not only does a lot of unnecessary blinking, it
+  //   also creates noticible fading artifacts on pixels _outside_ the partial frame window
+  // - only scan gates inside the partial window: this reduces the impact on pixels outside the partial window
+  // - sending the data and refresh twice: with the custom LUT, the pixels don't always "stick" when going from one state to the next, this helps
+  // Prep
+  LoadWaveform(waveform);
+  if (!old_plane_white) {
+    // Something left a frame where these waveforms expect white
+    SendCommand(DATA_START_TRANSMISSION_1);
+    SendDataFill(0xFF, width / 8 * height);
+    old_plane_white = true;
+  }
+  SendCommand(PARTIAL_IN);
+  partial_mode = true;
+
+  // x should be the multiple of 8, the last 3 bit will always be ignored
+  x = x & 0xFF8;
+  SendPartialWindow(x, y, w, l);
+
+  // Pull the window out of the full frame once, both passes send the same block
+  unsigned int window_bytes = 0;
+  if (frame_buffer != NULL) {
+    window_bytes = CopyWindow(frame_buffer, x, y, w, l);
+  }
 
   // We get better quality by doing it twice, and the custom LUT is very fast
-  for (int repeat = 0; repeat < 2; repeat++) {
+  for (int repeat = 0; repeat < passes; repeat++) {
     // Send data
     SendCommand(DATA_START_TRANSMISSION_2);
     if (frame_buffer != NULL) {
-      for(unsigned int i = 0; i < width * height / 8; i++) {
-        int x_i = (i * 8) % width;
-        int y_i = (i * 8) / width;
-        // If we're "in frame", send the data, otherwise pass
-        if (x_i >= x && x_i < x + w && y_i >= y && y_i < y + l) {
-          SendData(frame_buffer[i]);  
-        }
-      }  
+      SendDataBlock(window_buffer, window_bytes);
     } else {
-        for(unsigned int i = 0; i < w * l / 8; i++) {
-            SendData(0x00);  
-        }  
+      SendDataFill(0x00, w * l / 8);
     }
 
     SendCommand(DISPLAY_REFRESH); 
-    DelayMs(100);
-    WaitUntilIdle();
+    WaitUntilRefreshed();
   }
 
 
   SendCommand(PARTIAL_OUT);  
+  partial_mode = false;
 }
 
 /**
- *  @brief: set the look-up table
+ *  @brief: copies the rows of the window (x, y, w, l) out of a full frame buffer into
+ *          window_buffer, in panel format and in the order the controller expects them.
+ *          Returns the byte count. Like the PARTIAL_WINDOW registers, columns are whole bytes:
+ *          x rounds down, x + w - 1 up
  */
-void Epd::SetLut(void) {
-    unsigned int count;     
-    SendCommand(LUT_FOR_VCOM);                            //vcom
-    for(count = 0; count < 44; count++) {
-        SendData(lut_vcom0[count]);
+unsigned int Epd::CopyWindow(const unsigned char* frame_buffer, int x, int y, int w, int l) {
+    const unsigned int first_col = x / 8;
+    const unsigned int row_bytes = (x + w - 1) / 8 - first_col + 1;
+    const unsigned char* src = frame_buffer + y * frame_stride + first_col;
+    unsigned char* dst = window_buffer;
+    for (int row = 0; row < l; row++) {
+        if (frame_format == FRAME_FORMAT_CAIRO_A1) {
+            ConvertCairoA1ToPanel(src, dst, row_bytes);
+        } else {
+            memcpy(dst, src, row_bytes);
+        }
+        src += frame_stride;
+        dst += row_bytes;
     }
-    
+    return row_bytes * l;
+}
+
+/**
+ *  @brief: uploads the five waveform tables of a look-up table set
+ */
+void Epd::SendLut(const unsigned char* vcom, const unsigned char* ww, const unsigned char* bw,
+                  const unsigned char* wb, const unsigned char* bb) {
+    SendCommand(LUT_FOR_VCOM);                            //vcom
+    SendDataBlock(vcom, 44);
+
     SendCommand(LUT_WHITE_TO_WHITE);                      //ww --
-    for(count = 0; count < 42; count++) {
-        SendData(lut_ww[count]);
-    }   
-    
+    SendDataBlock(ww, 42);
+
     SendCommand(LUT_BLACK_TO_WHITE);                      //bw r
-    for(count = 0; count < 42; count++) {
-        SendData(lut_bw[count]);
-    } 
+    SendDataBlock(bw, 42);
 
     SendCommand(LUT_WHITE_TO_BLACK);                      //wb w
-    for(count = 0; count < 42; count++) {
-        SendData(lut_wb[count]);
-    } 
+    SendDataBlock(wb, 42);
 
     SendCommand(LUT_BLACK_TO_BLACK);                      //bb b
-    for(count = 0; count < 42; count++) {
-        SendData(lut_bb[count]);
-    } 
+    SendDataBlock(bb, 42);
 }
 
+/**
+ *  @brief: loads a waveform set into the LUT registers, unless it is already resident
+ */
+void Epd::LoadWaveform(EpdWaveform waveform) {
+    if (waveform == resident_waveform && band == resident_band) {
+        return;
+    }
+    if (band >= 0 && waveform != WAVEFORM_NONE && waveform != WAVEFORM_COUNT &&
+        bands[band].luts[waveform].tables == 0x1F) {
+        const EpdLutSet &set = bands[band].luts[waveform];
+        SendLut(set.vcom, set.ww, set.bw, set.wb, set.bb);
+        resident_waveform = waveform;
+        resident_band = band;
+        return;
+    }
+    switch (waveform) {
+        case WAVEFORM_FULL:
+            SendLut(lut_vcom0, lut_ww, lut_bw, lut_wb, lut_bb);
+            break;
+        case WAVEFORM_QUICK:
+            SendLut(lut_vcom0_quick, lut_ww_quick, lut_bw_quick, lut_wb_quick, lut_bb_quick);
+            break;
+        case WAVEFORM_BVZ:
+            SendLut(lut_vcom0_bvz, lut_ww_bvz, lut_bw_bvz, lut_wb_bvz, lut_bb_bvz);
+            break;
+        case WAVEFORM_BVZ_ADD:
+            // Pixels headed for white are already white: leave them alone
+            SendLut(lut_vcom0_bvz, lut_hold_bvz, lut_hold_bvz, lut_wb_bvz, lut_bb_bvz);
+            break;
+        case WAVEFORM_BVZ_SUB:
+            // Pixels headed for black are already black: leave them alone, and drive the
+            // white ones all the way, whatever the controller takes their old state to be
+            SendLut(lut_vcom0_bvz, lut_bw_bvz, lut_bw_bvz, lut_hold_bvz, lut_hold_bvz);
+            break;
+        case WAVEFORM_CLEANUP:
+            // Where pixels end up only depends on the new plane
+            SendLut(lut_vcom0_cleanup, lut_ww_cleanup, lut_ww_cleanup, lut_wb_cleanup, lut_wb_cleanup);
+            break;
+        case WAVEFORM_NONE:
+        case WAVEFORM_COUNT:
+            return;
+    }
+    resident_waveform = waveform;
+    resident_band = band;
+}
+
+static EpdWaveform WaveformByName(const char* name) {
+    static const char* names[WAVEFORM_COUNT] = { "", "full", "quick", "bvz", "bvz_add", "bvz_sub", "cleanup" };
+    for (int w = WAVEFORM_FULL; w < WAVEFORM_COUNT; w++) {
+        if (strcmp(name, names[w]) == 0) {
+            return (EpdWaveform) w;
+        }
+    }
+    return WAVEFORM_NONE;
+}
 
 /**
- *  @brief: set the look-up table for quick display (partial refresh)
+ *  @brief: loads waveform sets by temperature band from a text file, returns 0 on success.
+ *          '#' starts a comment. "band <name> <min C> <max C>" starts a band, and each
+ *          "<waveform> <table> <hex bytes>" line in it gives one LUT table, e.g.
+ *              band cold -20 11
+ *              bvz vcom 00 02 3c 01 00 01
+ *          waveform is one of full, quick, bvz, bvz_add, bvz_sub, cleanup, and table one of vcom,
+ *          ww, bw, wb, bb. Missing trailing bytes are zero. A band defines a waveform by
+ *          giving all five of its tables; the first band that covers the temperature is used
  */
+int Epd::LoadWaveformFile(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        std::cout << "No waveform file at " << path << ", using the built-in waveforms" << std::endl;
+        return -1;
+    }
 
-void Epd::SetLutQuick(void) {
-    unsigned int count;     
-    SendCommand(LUT_FOR_VCOM);                            //vcom
-    for(count = 0; count < 44; count++) {
-        SendData(lut_vcom0_quick[count]);
+    static const char* table_names[] = { "vcom", "ww", "bw", "wb", "bb" };
+    std::vector<EpdTemperatureBand> loaded;
+    char line[512];
+    int line_number = 0;
+    const char* error = NULL;
+    while (error == NULL && fgets(line, sizeof line, f) != NULL) {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char word[16];
+        int used = 0;
+        if (sscanf(line, "%15s%n", word, &used) != 1) {
+            continue;
+        }
+
+        if (strcmp(word, "band") == 0) {
+            char name[32];
+            EpdTemperatureBand band;
+            memset(band.luts, 0, sizeof band.luts);
+            if (sscanf(line + used, "%31s %d %d", name, &band.min_c, &band.max_c) != 3 ||
+                band.min_c > band.max_c) {
+                error = "expected band <name> <min C> <max C>";
+            } else {
+                band.name = name;
+                loaded.push_back(band);
+            }
+            continue;
+        }
+
+        EpdWaveform waveform = WaveformByName(word);
+        char table_name[8];
+        int table_used = 0;
+        if (waveform == WAVEFORM_NONE) {
+            error = "unknown waveform";
+        } else if (loaded.empty()) {
+            error = "waveform table outside a band";
+        } else if (sscanf(line + used, "%7s%n", table_name, &table_used) != 1) {
+            error = "missing table name";
+        }
+        if (error != NULL) {
+            continue;
+        }
+        EpdLutSet& set = loaded.back().luts[waveform];
+        unsigned char* tables[] = { set.vcom, set.ww, set.bw, set.wb, set.bb };
+        int table = 0;
+        while (table < 5 && strcmp(table_name, table_names[table]) != 0) {
+            table++;
+        }
+        if (table == 5) {
+            error = "unknown table";
+            continue;
+        }
+        size_t size = (table == 0) ? LUT_VCOM_SIZE : LUT_SIZE;
+        size_t count = 0;
+        char* cursor = line + used + table_used;
+        char* end;
+        for (unsigned long value = strtoul(cursor, &end, 16); end != cursor; value = strtoul(cursor, &end, 16)) {
+            if (count == size || value > 0xFF) {
+                error = "too many bytes, or a value over ff";
+                break;
+            }
+            tables[table][count++] = (unsigned char) value;
+            cursor = end;
+        }
+        set.tables |= 1 << table;
+    }
+    fclose(f);
+
+    for (size_t b = 0; b < loaded.size() && error == NULL; b++) {
+        for (int w = 0; w < WAVEFORM_COUNT; w++) {
+            if (loaded[b].luts[w].tables != 0 && loaded[b].luts[w].tables != 0x1F) {
+                error = "a waveform in a band is missing some of its five tables";
+                line_number = 0;
+            }
+        }
+    }
+    if (error != NULL) {
+        std::cout << "Bad waveform file " << path;
+        if (line_number > 0) {
+            std::cout << ", line " << line_number;
+        }
+        std::cout << ": " << error << std::endl;
+        return -1;
     }
-    
-    SendCommand(LUT_WHITE_TO_WHITE);                      //ww --
-    for(count = 0; count < 42; count++) {
-        SendData(lut_ww_quick[count]);
-    }   
-    
-    SendCommand(LUT_BLACK_TO_WHITE);                      //bw r
-    for(count = 0; count < 42; count++) {
-        SendData(lut_bw_quick[count]);
-    } 
 
-    SendCommand(LUT_WHITE_TO_BLACK);                      //wb w
-    for(count = 0; count < 42; count++) {
-        SendData(lut_wb_quick[count]);
-    } 
+    bands = loaded;
+    SelectBand();
+    std::cout << "Loaded " << bands.size() << " temperature bands from " << path << std::endl;
+    return 0;
+}
 
-    SendCommand(LUT_BLACK_TO_BLACK);                      //bb b
-    for(count = 0; count < 42; count++) {
-        SendData(lut_bb_quick[count]);
-    } 
+/**
+ *  @brief: reads the controller's temperature sensor, returns degrees C or TEMPERATURE_UNKNOWN.
+ *          The reading is 11 bit two's complement in 1/8 degrees, bits 10..3 in the first byte
+ *          and bits 2..0 at the top of the second. Modules whose data line can't be read back
+ *          return all ones or all zeros, which don't count as a reading
+ */
+int Epd::ReadTemperature(void) {
+    SendCommand(TEMPERATURE_SENSOR_COMMAND);
+    WaitUntilIdle();
+    DigitalWrite(dc_pin, HIGH);
+    unsigned char high = SpiReceive();
+    unsigned char low = SpiReceive();
+    if ((high == 0xFF && low == 0xFF) || (high == 0x00 && low == 0x00) || (low & 0x1F) != 0) {
+        return TEMPERATURE_UNKNOWN;
+    }
+    int reading = (high << 3) | (low >> 5);
+    if (reading & 0x400) {
+        reading -= 0x800;
+    }
+    int celsius = reading / 8;
+    if (celsius < TEMPERATURE_MIN_C || celsius > TEMPERATURE_MAX_C) {
+        return TEMPERATURE_UNKNOWN;
+    }
+    return celsius;
 }
 
-void Epd::SetLutBvz(void) {
-    unsigned int count;     
-    SendCommand(LUT_FOR_VCOM);                            //vcom
-    for(count = 0; count < 44; count++) {
-        SendData(lut_vcom0_bvz[count]);
+/**
+ *  @brief: reads the temperature and switches to the waveforms of its band. The new band's
+ *          waveforms are loaded the next time a waveform is needed
+ */
+void Epd::UpdateTemperature(void) {
+    int reading = ReadTemperature();
+    if (reading != TEMPERATURE_UNKNOWN) {
+        temperature = reading;
     }
-    
-    SendCommand(LUT_WHITE_TO_WHITE);                      //ww --
-    for(count = 0; count < 42; count++) {
-        SendData(lut_ww_bvz[count]);
-    }   
-    
-    SendCommand(LUT_BLACK_TO_WHITE);                      //bw r
-    for(count = 0; count < 42; count++) {
-        SendData(lut_bw_bvz[count]);
-    } 
+    SelectBand();
+}
 
-    SendCommand(LUT_WHITE_TO_BLACK);                      //wb w
-    for(count = 0; count < 42; count++) {
-        SendData(lut_wb_bvz[count]);
-    } 
+/**
+ *  @brief: the last plausible temperature reading, TEMPERATURE_UNKNOWN if there was none
+ */
+int Epd::GetTemperature(void) {
+    return temperature;
+}
 
-    SendCommand(LUT_BLACK_TO_BLACK);                      //bb b
-    for(count = 0; count < 42; count++) {
-        SendData(lut_bb_bvz[count]);
-    } 
+void Epd::SelectBand(void) {
+    int celsius = (temperature != TEMPERATURE_UNKNOWN) ? temperature : TEMPERATURE_ASSUMED_C;
+    int selected = -1;
+    for (size_t b = 0; b < bands.size() && selected < 0; b++) {
+        if (bands[b].min_c <= celsius && celsius <= bands[b].max_c) {
+            selected = b;
+        }
+    }
+    if (selected != band) {
+        std::cout << "Panel at " << celsius << "C" << (temperature == TEMPERATURE_UNKNOWN ? " (assumed)" : "")
+            << ", using " << (selected >= 0 ? bands[selected].name : std::string("built-in")) << " waveforms" << std::endl;
+        band = selected;
+    }
+}
+
+/**
+ *  @brief: set the look-up table
+ */
+void Epd::SetLut(void) {
+    LoadWaveform(WAVEFORM_FULL);
 }
 
 
+/**
+ *  @brief: set the look-up table for quick display (partial refresh)
+ */
+
+void Epd::SetLutQuick(void) {
+    LoadWaveform(WAVEFORM_QUICK);
+}
+
+void Epd::SetLutBvz(void) {
+    LoadWaveform(WAVEFORM_BVZ);
+}
+
+
+/**
+ * @brief: loads a full frame into the SRAM, this won't refresh the display
+ */
+void Epd::SetFrame(const unsigned char* frame_buffer) {
+    SendCommand(DATA_START_TRANSMISSION_1);
+    SendDataFill(0xFF, width / 8 * height);      // bit set: white, bit reset: black
+    old_plane_white = true;
+    DelayMs(2);
+    SendCommand(DATA_START_TRANSMISSION_2); 
+    if (frame_format == FRAME_FORMAT_PANEL && frame_stride == width / 8) {
+        SendDataBlock(frame_buffer, width / 8 * height);
+    } else {
+        SendDataBlock(window_buffer, CopyWindow(frame_buffer, 0, 0, width, height));
+    }
+    DelayMs(2);                  
+}
+
+/**
+ *  Note: both buffers are full screen frames in the frame format (ink: black, resp. red),
+ *  only the window is sent. Red needs the panel's own (OTP) black/white/red waveform,
+ *  which takes far longer than a black/white one and flashes the window a few times.
+ *  The pixels beside the window in its rows are driven all that time too, and may fade:
+ *  callers charge them to the ghosting model, which the simulator can't check
+ *  @brief: refreshes a window of the screen in black, white and red
+ */
+void Epd::DisplayColorWindow(const unsigned char* black_buffer, const unsigned char* red_buffer,
+                             int x, int y, int w, int l) {
+  SendCommand(PANEL_SETTING);
+  SendData(PANEL_SETTING_KWR_OTP_LUT);
+  SendCommand(PARTIAL_IN);
+  partial_mode = true;
+  x = x & 0xFF8;
+  SendPartialWindow(x, y, w, l);
+
+  // Black/white plane, then red plane: both use 0 for ink
+  SendCommand(DATA_START_TRANSMISSION_1);
+  unsigned int window_bytes = CopyWindow(black_buffer, x, y, w, l);
+  SendDataBlock(window_buffer, window_bytes);
+  SendCommand(DATA_START_TRANSMISSION_2);
+  SendDataBlock(window_buffer, CopyWindow(red_buffer, x, y, w, l));
+
+  SendCommand(DISPLAY_REFRESH);
+  color_mode = true;
+  WaitUntilRefreshed();
+  color_mode = false;
+  // Black/white refreshes expect white in DATA_START_TRANSMISSION_1, put it back for the window only
+  SendCommand(DATA_START_TRANSMISSION_1);
+  SendDataFill(0xFF, window_bytes);
+  SendCommand(PARTIAL_OUT);
+  partial_mode = false;
+  SendCommand(PANEL_SETTING);
+  SendData(PANEL_SETTING_KW_REGISTER_LUT);
+}
+
 /**
  * @brief: refresh and displays the frame
  */
 void Epd::DisplayFrame(const unsigned char* frame_buffer) {
     if (frame_buffer != NULL) {
-        SendCommand(DATA_START_TRANSMISSION_1);
-        for(unsigned int i = 0; i < width / 8 * height; i++) {
-            SendData(0xFF);      // bit set: white, bit reset: black
-        }
-        DelayMs(2);
-        SendCommand(DATA_START_TRANSMISSION_2); 
-        for(int i = 0; i < width / 8 * height; i++) {
-            SendData(frame_buffer[i]);
-        }  
-        DelayMs(2);                  
+        SetFrame(frame_buffer);
     }
 
     SetLut();
 
     SendCommand(DISPLAY_REFRESH); 
-    DelayMs(100);
-    WaitUntilIdle();
+    WaitUntilRefreshed();
 }
 
-
-
-
 /**
  * @brief: clear the frame data from the SRAM, this won't refresh the display
  */
@@ -347,15 +681,12 @@ void Epd::ClearFrame(void) {
 
     SendCommand(DATA_START_TRANSMISSION_1);           
     DelayMs(2);
-    for(unsigned int i = 0; i < width / 8 * height; i++) {
-        SendData(0xFF);  
-    }  
+    SendDataFill(0xFF, width / 8 * height);
+    old_plane_white = true;
     DelayMs(2);
     SendCommand(DATA_START_TRANSMISSION_2);           
     DelayMs(2);
-    for(unsigned int i = 0; i < width / 8 * height; i++) {
-        SendData(0xFF);  
-    }  
+    SendDataFill(0xFF, width / 8 * height);
     DelayMs(2);
 }
 
@@ -367,8 +698,7 @@ void Epd::ClearFrame(void) {
 void Epd::DisplayFrame(void) {
     SetLut();
     SendCommand(DISPLAY_REFRESH); 
-    DelayMs(100);
-    WaitUntilIdle();
+    WaitUntilRefreshed();
 }
 
 void Epd::DisplayFrameQuick(void) {
@@ -386,6 +716,8 @@ void Epd::DisplayFrameQuick(void) {
  *         You can use Epd::Reset() to awaken and use Epd::Init() to initialize.
  */
 void Epd::Sleep() {
+    // Deep sleep loses the LUT registers, waking up needs a Reset() anyway
+    resident_waveform = WAVEFORM_NONE;
     SendCommand(VCOM_AND_DATA_INTERVAL_SETTING);
     SendData(0x17);                       //border floating    
     SendCommand(VCM_DC_SETTING);          //VCOM to 0V
@@ -569,6 +901,17 @@ const unsigned char lut_wb_bvz[] ={
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 };
 
+// Keeps pixels where they are, for as long as the other bvz tables drive theirs
+const unsigned char lut_hold_bvz[] ={
+  0x00, // 00 00 00 00
+  TP0A, TP0B, 0x01, 0x00, 0x01,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
 
 
 
@@ -602,10 +945,46 @@ const unsigned char lut_wb_bvz[] ={
 
 
 
-
-/* END OF FILE */
 
 
+/* END OF FILE */
 
+// Ghosting cleanup of a partial window. Drives every pixel to the opposite state and back,
+// twice, for as long in one direction as in the other (DC balanced: no charge is left behind
+// in the ink). From registers, unlike the stock full waveform, which fades pixels outside the
+// window. Gates only scan the window's rows, see SendPartialWindow; what cells in those rows
+// outside the window still see is charged to them by the ghosting model
+const unsigned char lut_vcom0_cleanup[] =
+{
+  0x00, TP0B, TP0B, 0x00, 0x00, 0x02,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
 
+// Ends white: black, then white
+const unsigned char lut_ww_cleanup[] ={
+  0x60, // 01 10 00 00
+  TP0B, TP0B, 0x00, 0x00, 0x02,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
 
+// Ends black: white, then black
+const unsigned char lut_wb_cleanup[] ={
+  0x90, // 10 01 00 00
+  TP0B, TP0B, 0x00, 0x00, 0x02,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
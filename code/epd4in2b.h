@@ -28,12 +28,33 @@
 #define EPD4IN2_H
 
 #include <stdint.h>
+#include <string>
+#include <vector>
 #include "epdif.h"
 
 // Display resolution
 #define EPD_WIDTH       400
 #define EPD_HEIGHT      300
 
+// BUSY timing
+#define BUSY_TIMEOUT_MS             60000   // longest we wait for the controller to go idle
+#define REFRESH_START_TIMEOUT_MS      100   // longest BUSY takes to assert after DISPLAY_REFRESH
+#define TIMED_BLOCK_MIN_BYTES         512   // smallest data block used to measure SPI throughput
+
+// Panel temperature, in degrees C
+#define TEMPERATURE_UNKNOWN          -128   // no plausible reading from the sensor
+#define TEMPERATURE_MIN_C             -20   // readings outside this range are implausible
+#define TEMPERATURE_MAX_C              60
+#define TEMPERATURE_ASSUMED_C          22   // what picks the waveforms until there is a reading
+
+// PANEL_SETTING values: black/white with the LUTs from registers, for everything but colour
+// refreshes, which use black/white/red with the LUTs from OTP
+#define PANEL_SETTING_KW_REGISTER_LUT 0x3F
+#define PANEL_SETTING_KWR_OTP_LUT     0x0F
+
+#define LUT_VCOM_SIZE                  44
+#define LUT_SIZE                       42
+
 // EPD4IN2 commands
 #define PANEL_SETTING                               0x00
 #define POWER_SETTING                               0x01
@@ -74,6 +95,51 @@
 #define READ_OTP                                    0xA2
 #define POWER_SAVING                                0xE3
 
+// Waveform (LUT) sets that can be loaded into the controller
+enum EpdWaveform {
+    WAVEFORM_NONE,      // nothing known to be loaded, e.g. after a reset
+    WAVEFORM_FULL,      // lut_*: full refresh
+    WAVEFORM_QUICK,     // lut_*_quick
+    WAVEFORM_BVZ,       // lut_*_bvz: partial refresh
+    WAVEFORM_BVZ_ADD,   // partial refresh of a region where pixels only turn black
+    WAVEFORM_BVZ_SUB,   // partial refresh of a region where pixels only turn white
+    WAVEFORM_CLEANUP,   // lut_*_cleanup: partial refresh that clears ghosting in its window
+    WAVEFORM_COUNT
+};
+
+// Durations measured on this panel as it is driven, averaged, 0 until first measured
+struct EpdTiming {
+    uint32_t spi_ns_per_byte;                       // frame and window data
+    uint32_t refresh_us[WAVEFORM_COUNT];            // full screen refresh, by waveform
+    uint32_t partial_refresh_us[WAVEFORM_COUNT];    // one pass of a partial window, by waveform
+    uint32_t color_refresh_us;                      // a colour window, with the OTP waveform
+};
+
+// One waveform's LUT tables, from a waveform file (see Epd::LoadWaveformFile)
+struct EpdLutSet {
+    unsigned char tables;       // bit per table given: vcom, ww, bw, wb, bb
+    unsigned char vcom[LUT_VCOM_SIZE];
+    unsigned char ww[LUT_SIZE];
+    unsigned char bw[LUT_SIZE];
+    unsigned char wb[LUT_SIZE];
+    unsigned char bb[LUT_SIZE];
+};
+
+// Waveforms to use while the panel is between min_c and max_c, inclusive. Waveforms
+// the band doesn't define use the compiled-in lut_* tables
+struct EpdTemperatureBand {
+    std::string name;
+    int min_c;
+    int max_c;
+    EpdLutSet luts[WAVEFORM_COUNT];
+};
+
+// Layouts frame buffers can be handed to Epd in
+enum EpdFrameFormat {
+    FRAME_FORMAT_PANEL,     // what the controller takes: first pixel in the MSB, bit set: white
+    FRAME_FORMAT_CAIRO_A1,  // cairo's CAIRO_FORMAT_A1 image data, converted as it is sent
+};
+
 extern const unsigned char lut_vcom0[];
 extern const unsigned char lut_ww[];
 extern const unsigned char lut_bw[];
@@ -91,6 +157,11 @@ extern const unsigned char lut_ww_bvz[];
 extern const unsigned char lut_bw_bvz[];
 extern const unsigned char lut_bb_bvz[];
 extern const unsigned char lut_wb_bvz[];
+extern const unsigned char lut_hold_bvz[];
+
+extern const unsigned char lut_vcom0_cleanup[];
+extern const unsigned char lut_ww_cleanup[];
+extern const unsigned char lut_wb_cleanup[];
 
 
 
@@ -105,28 +176,72 @@ public:
     int  Init(void);
     void SendCommand(unsigned char command);
     void SendData(unsigned char data);
+    void SendDataBlock(const unsigned char* data, size_t len);
+    void SendDataFill(unsigned char value, size_t len);
     void WaitUntilIdle(void);
+    void WaitUntilRefreshed(void);
     void Reset(void);
+    void SetFrameFormat(EpdFrameFormat format, unsigned int stride);
   
     void SetPartialWindow(const unsigned char* frame_buffer, int x, int y, int w, int l, int dtm);
-    void DisplayPartialFrame(const unsigned char* frame_buffer, int x, int y, int w, int l);
+    void DisplayPartialFrame(const unsigned char* frame_buffer, int x, int y, int w, int l,
+                             EpdWaveform waveform = WAVEFORM_BVZ, int passes = 2);
+    void DisplayColorWindow(const unsigned char* black_buffer, const unsigned char* red_buffer,
+                            int x, int y, int w, int l);
 
     void SetPartialWindowBlack(const unsigned char* buffer_black, int x, int y, int w, int l);
     void SetPartialWindowRed(const unsigned char* buffer_red, int x, int y, int w, int l);
     void SetLut(void);
     void SetLutQuick(void);
     void SetLutBvz(void);
+    void LoadWaveform(EpdWaveform waveform);
+    void SetFrame(const unsigned char* frame_buffer);
     void DisplayFrame(const unsigned char* frame_buffer);
     void DisplayFrame(void);
     void DisplayFrameQuick(void);
+    const EpdTiming& GetTiming(void);
+    int  LoadWaveformFile(const char* path);
+    int  ReadTemperature(void);
+    void UpdateTemperature(void);
+    int  GetTemperature(void);
     void ClearFrame(void);
     void Sleep(void);
 
 private:
+    unsigned int CopyWindow(const unsigned char* frame_buffer, int x, int y, int w, int l);
+    void SendPartialWindow(int x, int y, int w, int l);
+    void SendLut(const unsigned char* vcom, const unsigned char* ww, const unsigned char* bw,
+                 const unsigned char* wb, const unsigned char* bb);
+    void SelectBand(void);
+
     unsigned int reset_pin;
     unsigned int dc_pin;
     unsigned int cs_pin;
     unsigned int busy_pin;
+
+    // Layout of the frame buffers passed to DisplayFrame and DisplayPartialFrame
+    EpdFrameFormat frame_format;
+    unsigned int frame_stride;
+
+    // Waveform currently in the controller's LUT registers, and the temperature band it was
+    // loaded for, so unchanged ones aren't re-sent
+    EpdWaveform resident_waveform;
+    int resident_band;
+    // Waveform sets by temperature band, the one in use (-1: compiled-in tables) and the
+    // last plausible temperature reading
+    std::vector<EpdTemperatureBand> bands;
+    int band;
+    int temperature;
+    // Whether the controller is between PARTIAL_IN and PARTIAL_OUT
+    bool partial_mode;
+    // Whether the refresh under way uses the OTP colour waveform, timed apart from the others
+    bool color_mode;
+    // Whether DATA_START_TRANSMISSION_1 holds all white, as black/white refreshes expect
+    bool old_plane_white;
+    EpdTiming timing;
+
+    // Staging area for the bytes of a partial window, packed row after row
+    unsigned char window_buffer[EPD_WIDTH / 8 * EPD_HEIGHT];
 };
 
 #endif /* EPD4IN2_H */
@@ -27,6 +27,46 @@
 
 #include "epdif.h"
 #include <bcm2835.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+
+#define GPIO_CHIP_DEVICE "/dev/gpiochip0"
+
+// Line event handle for BUSY_PIN from the GPIO character device, -1 if unavailable
+static int busy_event_fd = -1;
+
+static unsigned int MsSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ *  Requests edge events for the BUSY line, so waiting for it can sleep in the kernel
+ *  instead of polling. Falls back to polling if the character device isn't there.
+ */
+static void OpenBusyLineEvents(void) {
+    int chip_fd = open(GPIO_CHIP_DEVICE, O_RDONLY | O_CLOEXEC);
+    if (chip_fd < 0) {
+        return;
+    }
+    struct gpioevent_request request;
+    memset(&request, 0, sizeof request);
+    request.lineoffset = BUSY_PIN;
+    request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    request.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+    strncpy(request.consumer_label, "upNext-busy", sizeof request.consumer_label - 1);
+    if (ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &request) == 0) {
+        busy_event_fd = request.fd;
+        fcntl(busy_event_fd, F_SETFL, fcntl(busy_event_fd, F_GETFL) | O_NONBLOCK);
+    }
+    close(chip_fd);
+}
 
 EpdIf::EpdIf() {
 };
@@ -45,10 +85,54 @@ void EpdIf::DelayMs(unsigned int delaytime) {
     bcm2835_delay(delaytime);
 }
 
+uint64_t EpdIf::MonotonicUs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+/**
+ *  Waits until pin reads value, for at most timeout_ms. Returns 0 once it does, -1 on timeout.
+ *  Edges are queued by the kernel from the moment the line is requested, so one that happens
+ *  between reading the level and calling poll still wakes us up.
+ */
+int EpdIf::WaitForLevel(int pin, int value, unsigned int timeout_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (bcm2835_gpio_lev(pin) != value) {
+        unsigned int elapsed = MsSince(&start);
+        if (elapsed >= timeout_ms) {
+            return -1;
+        }
+        if (pin == BUSY_PIN && busy_event_fd >= 0) {
+            struct pollfd pfd = { busy_event_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, timeout_ms - elapsed) > 0) {
+                struct gpioevent_data event;
+                while (read(busy_event_fd, &event, sizeof event) == sizeof event) {
+                    // Drain, the level is re-read above
+                }
+            }
+        } else {
+            bcm2835_delay(1);
+        }
+    }
+    return 0;
+}
+
 void EpdIf::SpiTransfer(unsigned char data) {
     bcm2835_spi_transfer(data);
 }
 
+unsigned char EpdIf::SpiReceive(void) {
+    // Clocks a dummy byte out, and whatever the controller sends back in
+    return bcm2835_spi_transfer(0x00);
+}
+
+void EpdIf::SpiTransferBlock(const uint8_t* data, size_t len) {
+    // Streams the whole buffer in one go, chip select stays asserted throughout
+    bcm2835_spi_writenb((const char *) data, (uint32_t) len);
+}
+
 int EpdIf::IfInit(void) {
     if(!bcm2835_init()) {
         return -1;
@@ -56,6 +140,9 @@ int EpdIf::IfInit(void) {
     bcm2835_gpio_fsel(RST_PIN, BCM2835_GPIO_FSEL_OUTP);
     bcm2835_gpio_fsel(DC_PIN, BCM2835_GPIO_FSEL_OUTP);
     bcm2835_gpio_fsel(BUSY_PIN, BCM2835_GPIO_FSEL_INPT);
+    if (busy_event_fd < 0) {
+        OpenBusyLineEvents();
+    }
 
     bcm2835_spi_begin();                                          //Start spi interface, set spi pin for the reuse function
     bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);     //High first transmission
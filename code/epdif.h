@@ -28,6 +28,9 @@
 #ifndef EPDIF_H
 #define EPDIF_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 // Pin definition
 #define RST_PIN         17
 #define DC_PIN          25
@@ -47,6 +50,10 @@ public:
     static void DigitalWrite(int pin, int value); 
     static int  DigitalRead(int pin);
     static void DelayMs(unsigned int delaytime);
+    static uint64_t MonotonicUs(void);
+    static int  WaitForLevel(int pin, int value, unsigned int timeout_ms);
     static void SpiTransfer(unsigned char data);
+    static void SpiTransferBlock(const uint8_t* data, size_t len);
+    static unsigned char SpiReceive(void);
 };
 #endif
@@ -0,0 +1,521 @@
+/**
+ *  @filename   :   epdif_sim.cpp
+ *  @brief      :   Hardware-free implementation of the EPD interface functions
+ *                  Builds instead of epdif.cpp with `make EPD_BACKEND=sim`, see epdif_sim.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <algorithm>    // std::min, std::max
+#include "epdif.h"
+#include "epdif_sim.h"
+#include "epd4in2b.h"
+
+#define SIM_PLANE_SIZE      (EPD_WIDTH / 8 * EPD_HEIGHT)
+#define SIM_LUT_COUNT       5
+#define SIM_LUT_SIZE        44
+#define SIM_POWER_ON_NS     80000000ull
+#define SIM_POWER_OFF_NS    40000000ull
+#define SIM_REFRESH_SETUP_NS 20000000ull
+#define SIM_TEMPERATURE_NS  10000000ull
+
+namespace {
+
+// In-memory model of the panel controller
+struct Controller {
+    int dc;
+    bool deep_sleep;
+
+    unsigned char command;
+    unsigned int data_index;
+
+    // SRAM planes: DATA_START_TRANSMISSION_1 ("old" / black-white) and _2 ("new" / red)
+    unsigned char sram[2][SIM_PLANE_SIZE];
+    int sram_plane;
+    unsigned int sram_pointer;
+
+    // What the panel currently shows: black/white, and red on top of it (bit reset: red)
+    unsigned char displayed[SIM_PLANE_SIZE];
+    unsigned char displayed_red[SIM_PLANE_SIZE];
+
+    // Registers
+    unsigned char panel_setting;
+    unsigned char pll;
+    unsigned char luts[SIM_LUT_COUNT][SIM_LUT_SIZE];
+    bool partial_mode;
+    unsigned char partial_window[9];
+    unsigned int hrst, hred, vrst, vred;
+
+    // Bytes the controller answers a read command with
+    unsigned char response[2];
+    unsigned int response_len;
+    unsigned int response_pos;
+};
+
+struct Config {
+    double spi_hz;
+    double frame_hz;
+    double refresh_ms;
+    double time_scale;
+    const char *dump_dir;
+    double temperature_c;
+};
+
+Controller ctrl;
+Config config;
+EpdSimStats stats;
+
+uint64_t now_ns;            // modelled time
+uint64_t busy_until_ns;
+uint64_t unslept_ns;        // modelled time not yet mirrored onto the wall clock
+unsigned int dump_index;
+
+double EnvDouble(const char *name, double fallback) {
+    const char *value = getenv(name);
+    return (value != NULL && *value != '\0') ? atof(value) : fallback;
+}
+
+void SleepFor(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+
+/**
+ *  Advances modelled time. The wall clock follows (scaled), but short SPI transfers are
+ *  batched into sleeps of at least a millisecond so the model doesn't drown in syscalls.
+ */
+void Advance(uint64_t ns, bool flush) {
+    now_ns += ns;
+    stats.elapsed_ns += ns;
+    if (config.time_scale <= 0) {
+        return;
+    }
+    unslept_ns += (uint64_t) (ns * config.time_scale);
+    if (unslept_ns >= 1000000ull || (flush && unslept_ns > 0)) {
+        SleepFor(unslept_ns);
+        unslept_ns = 0;
+    }
+}
+
+double FrameRate(void) {
+    if (config.frame_hz > 0) {
+        return config.frame_hz;
+    }
+    // Values documented for PLL_CONTROL in Epd::Init
+    switch (ctrl.pll) {
+        case 0x3A: return 100;
+        case 0x29: return 150;
+        case 0x39: return 200;
+        case 0x31: return 171;
+        case 0x0B: return 10;
+        default:   return 50;
+    }
+}
+
+/**
+ *  A LUT table is a list of 6 byte phase groups: level select, four frame counts, repeat count.
+ *  The refresh lasts as long as the longest of the five tables.
+ */
+uint64_t RefreshDurationNs(void) {
+    if (config.refresh_ms > 0) {
+        return (uint64_t) (config.refresh_ms * 1000000.0);
+    }
+    if (!(ctrl.panel_setting & 0x20)) {
+        // LUT from OTP: the stock full-screen waveforms, red ones are much slower
+        return (ctrl.panel_setting & 0x10) ? 4000000000ull : 15000000000ull;
+    }
+    unsigned int max_frames = 0;
+    for (int lut = 0; lut < SIM_LUT_COUNT; lut++) {
+        unsigned int frames = 0;
+        for (int group = 0; group + 6 <= SIM_LUT_SIZE; group += 6) {
+            const unsigned char *g = ctrl.luts[lut] + group;
+            unsigned int repeat = std::max(1, (int) g[5]);
+            frames += (g[1] + g[2] + g[3] + g[4]) * repeat;
+        }
+        max_frames = std::max(max_frames, frames);
+    }
+    return SIM_REFRESH_SETUP_NS + (uint64_t) (max_frames * 1000000000.0 / FrameRate());
+}
+
+void SetBusy(uint64_t duration_ns) {
+    busy_until_ns = now_ns + duration_ns;
+    stats.busy_ns += duration_ns;
+}
+
+void DumpDisplayed(void) {
+    if (config.dump_dir == NULL) {
+        return;
+    }
+    char path[512];
+    snprintf(path, sizeof path, "%s/frame-%05u.pbm", config.dump_dir, dump_index++);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        std::cout << "[sim] Could not write " << path << std::endl;
+        return;
+    }
+    // PBM: bit set is black, the panel uses bit set for white
+    fprintf(f, "P4\n%d %d\n", EPD_WIDTH, EPD_HEIGHT);
+    for (unsigned int i = 0; i < SIM_PLANE_SIZE; i++) {
+        fputc(ctrl.displayed[i] ^ 0xFF, f);
+    }
+    fclose(f);
+}
+
+/**
+ *  Where a LUT table leaves the pixels it drives: the level of its last driving phase,
+ *  1 for white (VDL), 0 for black (VDH), or -1 if it never drives them and they stay put.
+ *  Each phase group's level select holds 4 two-bit levels, one per frame count.
+ */
+int LutResult(const unsigned char *lut) {
+    int result = -1;
+    for (int group = 0; group + 6 <= SIM_LUT_SIZE; group += 6) {
+        const unsigned char *g = lut + group;
+        for (int phase = 0; phase < 4; phase++) {
+            unsigned int level = (g[0] >> (6 - 2 * phase)) & 0x03;
+            if (g[1 + phase] != 0 && g[5] != 0 && (level == 0x01 || level == 0x02)) {
+                result = level == 0x02 ? 1 : 0;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ *  Shows columns first_col..last_col of rows first_row..last_row. B/W/R mode: the panel shows the
+ *  black/white plane (DTM1) with the red one (DTM2) on top. B/W mode removes any red; with the
+ *  LUTs from OTP the panel ends up showing the "new" data plane; with LUTs from registers, each
+ *  pixel goes wherever the table selected by its old (DTM1) and new (DTM2) bits takes it
+ */
+void ShowRows(unsigned int first_col, unsigned int last_col, unsigned int first_row, unsigned int last_row) {
+    const unsigned int row_bytes = EPD_WIDTH / 8;
+    if (!(ctrl.panel_setting & 0x10)) {
+        for (unsigned int row = first_row; row <= last_row; row++) {
+            memcpy(ctrl.displayed + row * row_bytes + first_col,
+                   ctrl.sram[0] + row * row_bytes + first_col, last_col - first_col + 1);
+            memcpy(ctrl.displayed_red + row * row_bytes + first_col,
+                   ctrl.sram[1] + row * row_bytes + first_col, last_col - first_col + 1);
+        }
+        return;
+    }
+    for (unsigned int row = first_row; row <= last_row; row++) {
+        memset(ctrl.displayed_red + row * row_bytes + first_col, 0xFF, last_col - first_col + 1);
+    }
+    if (!(ctrl.panel_setting & 0x20)) {
+        for (unsigned int row = first_row; row <= last_row; row++) {
+            memcpy(ctrl.displayed + row * row_bytes + first_col,
+                   ctrl.sram[1] + row * row_bytes + first_col, last_col - first_col + 1);
+        }
+        return;
+    }
+    // Indexed by old bit * 2 + new bit (bit set: white): bb, wb, bw, ww
+    int result[4];
+    result[0] = LutResult(ctrl.luts[LUT_BLACK_TO_BLACK - LUT_FOR_VCOM]);
+    result[1] = LutResult(ctrl.luts[LUT_BLACK_TO_WHITE - LUT_FOR_VCOM]);
+    result[2] = LutResult(ctrl.luts[LUT_WHITE_TO_BLACK - LUT_FOR_VCOM]);
+    result[3] = LutResult(ctrl.luts[LUT_WHITE_TO_WHITE - LUT_FOR_VCOM]);
+    for (unsigned int row = first_row; row <= last_row; row++) {
+        for (unsigned int col = first_col; col <= last_col; col++) {
+            unsigned int i = row * row_bytes + col;
+            unsigned char shown = ctrl.displayed[i];
+            for (int bit = 0; bit < 8; bit++) {
+                int old_bit = (ctrl.sram[0][i] >> bit) & 1;
+                int new_bit = (ctrl.sram[1][i] >> bit) & 1;
+                int to = result[old_bit * 2 + new_bit];
+                if (to >= 0) {
+                    shown = (shown & ~(1 << bit)) | (to << bit);
+                }
+            }
+            ctrl.displayed[i] = shown;
+        }
+    }
+}
+
+void Refresh(void) {
+    uint64_t duration = RefreshDurationNs();
+    unsigned int row_bytes = EPD_WIDTH / 8;
+    if (ctrl.partial_mode) {
+        unsigned int first_col = ctrl.hrst / 8;
+        unsigned int last_col = std::min(ctrl.hred / 8, row_bytes - 1);
+        unsigned int last_row = std::min(ctrl.vred, (unsigned int) EPD_HEIGHT - 1);
+        ShowRows(first_col, last_col, ctrl.vrst, last_row);
+        stats.partial_refreshes++;
+        std::cout << "[sim] Partial refresh " << (ctrl.hred - ctrl.hrst + 1) << "x" << (ctrl.vred - ctrl.vrst + 1)
+            << " at (" << ctrl.hrst << "," << ctrl.vrst << "): " << duration / 1000000 << "ms" << std::endl;
+    } else {
+        ShowRows(0, row_bytes - 1, 0, EPD_HEIGHT - 1);
+        stats.full_refreshes++;
+        std::cout << "[sim] Full refresh: " << duration / 1000000 << "ms" << std::endl;
+    }
+    SetBusy(duration);
+    DumpDisplayed();
+}
+
+void StartCommand(unsigned char command) {
+    stats.commands++;
+    ctrl.command = command;
+    ctrl.data_index = 0;
+    ctrl.response_len = 0;
+
+    switch (command) {
+        case DATA_START_TRANSMISSION_1:
+        case DATA_START_TRANSMISSION_2:
+            ctrl.sram_plane = (command == DATA_START_TRANSMISSION_1) ? 0 : 1;
+            ctrl.sram_pointer = 0;
+            break;
+        case LUT_FOR_VCOM:
+            stats.lut_uploads++;
+            break;
+        case PARTIAL_IN:
+            ctrl.partial_mode = true;
+            break;
+        case PARTIAL_OUT:
+            ctrl.partial_mode = false;
+            break;
+        case POWER_ON:
+            SetBusy(SIM_POWER_ON_NS);
+            break;
+        case POWER_OFF:
+            SetBusy(SIM_POWER_OFF_NS);
+            break;
+        case DISPLAY_REFRESH:
+            Refresh();
+            break;
+        case TEMPERATURE_SENSOR_COMMAND: {
+            // 11 bit two's complement reading in 1/8 degrees: bits 10..3, then bits 2..0 at the top
+            int reading = (int) (config.temperature_c * 8) & 0x7FF;
+            ctrl.response[0] = reading >> 3;
+            ctrl.response[1] = (reading & 0x07) << 5;
+            ctrl.response_len = 2;
+            ctrl.response_pos = 0;
+            SetBusy(SIM_TEMPERATURE_NS);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void WriteSram(unsigned char data) {
+    unsigned int row_bytes = EPD_WIDTH / 8;
+    unsigned int offset;
+    if (ctrl.partial_mode) {
+        // Data fills the partial window row by row
+        unsigned int window_bytes = ctrl.hred / 8 - ctrl.hrst / 8 + 1;
+        unsigned int row = ctrl.vrst + ctrl.sram_pointer / window_bytes;
+        unsigned int col = ctrl.hrst / 8 + ctrl.sram_pointer % window_bytes;
+        if (row > ctrl.vred || col >= row_bytes) {
+            return;
+        }
+        offset = row * row_bytes + col;
+    } else {
+        offset = ctrl.sram_pointer;
+    }
+    if (offset < SIM_PLANE_SIZE) {
+        ctrl.sram[ctrl.sram_plane][offset] = data;
+    }
+    ctrl.sram_pointer++;
+}
+
+void ReceiveData(unsigned char data) {
+    stats.data_bytes++;
+    unsigned int index = ctrl.data_index++;
+
+    switch (ctrl.command) {
+        case DATA_START_TRANSMISSION_1:
+        case DATA_START_TRANSMISSION_2:
+            WriteSram(data);
+            break;
+        case LUT_FOR_VCOM:
+        case LUT_WHITE_TO_WHITE:
+        case LUT_BLACK_TO_WHITE:
+        case LUT_WHITE_TO_BLACK:
+        case LUT_BLACK_TO_BLACK:
+            if (index < SIM_LUT_SIZE) {
+                ctrl.luts[ctrl.command - LUT_FOR_VCOM][index] = data;
+            }
+            break;
+        case PARTIAL_WINDOW:
+            if (index < sizeof ctrl.partial_window) {
+                unsigned char *w = ctrl.partial_window;
+                w[index] = data;
+                ctrl.hrst = ((w[0] & 0x01) << 8 | w[1]) & 0x1F8;
+                ctrl.hred = ((w[2] & 0x01) << 8 | w[3]) | 0x07;
+                ctrl.vrst = (w[4] & 0x01) << 8 | w[5];
+                ctrl.vred = (w[6] & 0x01) << 8 | w[7];
+            }
+            break;
+        case PANEL_SETTING:
+            if (index == 0) {
+                ctrl.panel_setting = data;
+            }
+            break;
+        case PLL_CONTROL:
+            if (index == 0) {
+                ctrl.pll = data;
+            }
+            break;
+        case DEEP_SLEEP:
+            if (data == 0xA5) {
+                ctrl.deep_sleep = true;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void ReceiveByte(unsigned char byte) {
+    if (ctrl.deep_sleep) {
+        // Only a hardware reset wakes the controller up
+        return;
+    }
+    if (ctrl.dc == LOW) {
+        StartCommand(byte);
+    } else {
+        ReceiveData(byte);
+    }
+}
+
+void ResetController(void) {
+    // Registers go back to their power-on defaults, SRAM content is left as is
+    ctrl.deep_sleep = false;
+    ctrl.command = 0xFF;
+    ctrl.data_index = 0;
+    ctrl.panel_setting = 0x0F;
+    ctrl.pll = 0x3C;
+    ctrl.partial_mode = false;
+    memset(ctrl.luts, 0, sizeof ctrl.luts);
+    memset(ctrl.partial_window, 0, sizeof ctrl.partial_window);
+    ctrl.hrst = ctrl.vrst = 0;
+    ctrl.hred = EPD_WIDTH - 1;
+    ctrl.vred = EPD_HEIGHT - 1;
+    ctrl.response_len = ctrl.response_pos = 0;
+}
+
+uint64_t SpiNs(size_t bytes) {
+    return (uint64_t) (bytes * 8 * 1000000000.0 / config.spi_hz);
+}
+
+} // namespace
+
+const EpdSimStats& EpdSimGetStats(void) {
+    return stats;
+}
+
+void EpdSimResetStats(void) {
+    memset(&stats, 0, sizeof stats);
+}
+
+const unsigned char* EpdSimGetDisplayedImage(void) {
+    return ctrl.displayed;
+}
+
+const unsigned char* EpdSimGetDisplayedRed(void) {
+    return ctrl.displayed_red;
+}
+
+EpdIf::EpdIf() {
+};
+EpdIf::~EpdIf() {
+};
+
+void EpdIf::DigitalWrite(int pin, int value) {
+    if (pin == DC_PIN) {
+        ctrl.dc = value;
+    } else if (pin == RST_PIN && value == LOW) {
+        ResetController();
+    }
+}
+
+int EpdIf::DigitalRead(int pin) {
+    if (pin == BUSY_PIN) {
+        Advance(0, true);
+        return now_ns >= busy_until_ns ? HIGH : LOW;     // 0: busy, 1: idle
+    }
+    return LOW;
+}
+
+void EpdIf::DelayMs(unsigned int delaytime) {
+    Advance(delaytime * 1000000ull, true);
+}
+
+uint64_t EpdIf::MonotonicUs(void) {
+    // Modelled time, so measurements come out the same whatever EPD_SIM_TIME_SCALE is
+    return now_ns / 1000;
+}
+
+int EpdIf::WaitForLevel(int pin, int value, unsigned int timeout_ms) {
+    uint64_t timeout_ns = timeout_ms * 1000000ull;
+    if (pin != BUSY_PIN) {
+        if (DigitalRead(pin) != value) {
+            Advance(timeout_ns, true);
+            return -1;
+        }
+        return 0;
+    }
+    // BUSY only ever changes at busy_until_ns, so sleep straight to it
+    bool busy = now_ns < busy_until_ns;
+    if ((value == HIGH) != busy) {
+        return 0;
+    }
+    if (value == LOW || busy_until_ns - now_ns > timeout_ns) {
+        Advance(timeout_ns, true);
+        return -1;
+    }
+    Advance(busy_until_ns - now_ns, true);
+    return 0;
+}
+
+void EpdIf::SpiTransfer(unsigned char data) {
+    ReceiveByte(data);
+    stats.spi_ns += SpiNs(1);
+    Advance(SpiNs(1), false);
+}
+
+unsigned char EpdIf::SpiReceive(void) {
+    stats.spi_ns += SpiNs(1);
+    Advance(SpiNs(1), false);
+    if (ctrl.dc == HIGH && ctrl.response_pos < ctrl.response_len) {
+        return ctrl.response[ctrl.response_pos++];
+    }
+    // Nothing driving the line
+    return 0xFF;
+}
+
+void EpdIf::SpiTransferBlock(const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        ReceiveByte(data[i]);
+    }
+    stats.spi_ns += SpiNs(len);
+    Advance(SpiNs(len), false);
+}
+
+int EpdIf::IfInit(void) {
+    config.spi_hz = EnvDouble("EPD_SIM_SPI_HZ", 250000000.0 / 128);
+    config.frame_hz = EnvDouble("EPD_SIM_FRAME_HZ", 0);
+    config.refresh_ms = EnvDouble("EPD_SIM_REFRESH_MS", 0);
+    config.time_scale = EnvDouble("EPD_SIM_TIME_SCALE", 1);
+    config.dump_dir = getenv("EPD_SIM_DUMP_DIR");
+    config.temperature_c = EnvDouble("EPD_SIM_TEMPERATURE", 22);
+    if (config.spi_hz <= 0) {
+        return -1;
+    }
+
+    ResetController();
+    ctrl.dc = HIGH;
+    memset(ctrl.sram, 0xFF, sizeof ctrl.sram);
+    memset(ctrl.displayed, 0xFF, sizeof ctrl.displayed);
+    memset(ctrl.displayed_red, 0xFF, sizeof ctrl.displayed_red);
+    now_ns = busy_until_ns = unslept_ns = 0;
+    EpdSimResetStats();
+
+    std::cout << "Using simulated e-Paper backend (SPI " << config.spi_hz << "Hz, time scale "
+        << config.time_scale << ")" << std::endl;
+    return 0;
+}
@@ -0,0 +1,42 @@
+/**
+ *  @filename   :   epdif_sim.h
+ *  @brief      :   Statistics and inspection hooks for the simulated EPD interface (epdif_sim.cpp)
+ *
+ *  The simulated backend replaces epdif.cpp when building with `make EPD_BACKEND=sim`.
+ *  It decodes the command/data stream sent by Epd into an in-memory model of the
+ *  panel controller, and drives BUSY from a timing model of the loaded waveforms.
+ *
+ *  Runtime configuration, all optional, via environment variables:
+ *    EPD_SIM_SPI_HZ        SPI clock used to cost transfers (default 1953125, i.e. 250MHz / 128)
+ *    EPD_SIM_FRAME_HZ      waveform frame rate (default: derived from PLL_CONTROL, 50Hz)
+ *    EPD_SIM_REFRESH_MS    fixed refresh duration, overriding the LUT-derived one
+ *    EPD_SIM_TIME_SCALE    multiplier applied to modelled time when sleeping (default 1, 0 = don't sleep)
+ *    EPD_SIM_DUMP_DIR      if set, the displayed image is written there as a PBM after every refresh
+ *    EPD_SIM_TEMPERATURE   what the controller's temperature sensor reads, in degrees C (default 22)
+ */
+
+#ifndef EPDIF_SIM_H
+#define EPDIF_SIM_H
+
+#include <stdint.h>
+
+struct EpdSimStats {
+    uint64_t commands;          // command bytes received
+    uint64_t data_bytes;        // data bytes received
+    uint64_t spi_ns;            // modelled time spent clocking bytes over SPI
+    uint64_t busy_ns;           // modelled time BUSY was asserted
+    uint64_t elapsed_ns;        // modelled time since IfInit
+    unsigned int full_refreshes;
+    unsigned int partial_refreshes;
+    unsigned int lut_uploads;   // LUT_FOR_VCOM commands received
+};
+
+const EpdSimStats& EpdSimGetStats(void);
+void EpdSimResetStats(void);
+
+// Displayed image, in panel format (1 bit per pixel, bit set: white), EPD_WIDTH / 8 * EPD_HEIGHT bytes
+const unsigned char* EpdSimGetDisplayedImage(void);
+// Red shown on top of it, same format (bit reset: red)
+const unsigned char* EpdSimGetDisplayedRed(void);
+
+#endif
@@ -0,0 +1,579 @@
+/**
+ *  @filename   :   event.cpp
+ *  @brief      :   Compact calendar events, parsed straight out of event list responses
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include "event.h"
+
+// Nesting deeper than this in a response is taken as garbage
+#define MAX_SKIP_DEPTH 64
+// Longest member name worth reading, anything longer isn't one we want
+#define MAX_KEY_LENGTH 32
+
+const char * StringPool::Intern(const char *s, size_t length) {
+  return strings.insert(std::string(s, length)).first->c_str();
+}
+
+const char * StringPool::Intern(const char *s) {
+  return s != NULL ? Intern(s, strlen(s)) : NULL;
+}
+
+void StringPool::Clear(void) {
+  strings.clear();
+}
+
+EventList::EventList() {
+}
+
+/**
+ *  @brief: appends a copy of event, with its strings interned here
+ */
+void EventList::Add(const Event &event) {
+  Event copy = event;
+  copy.id = strings.Intern(event.id);
+  copy.summary = strings.Intern(event.summary);
+  copy.location = strings.Intern(event.location);
+  events.push_back(copy);
+}
+
+void EventList::Clear(void) {
+  events.clear();
+  strings.Clear();
+}
+
+static bool SameString(const char *a, const char *b) {
+  return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+/**
+ *  @brief: whether other holds the same events, in the same order
+ */
+bool EventList::Same(const EventList &other) const {
+  if (events.size() != other.events.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < events.size(); i++) {
+    const Event &a = events[i];
+    const Event &b = other.events[i];
+    if (a.start != b.start || a.end != b.end || a.status != b.status || a.flags != b.flags ||
+        !SameString(a.id, b.id) || !SameString(a.summary, b.summary) || !SameString(a.location, b.location)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CopyEventPage(const EventPage &from, EventPage &to) {
+  to.items.Clear();
+  for (size_t i = 0; i < from.items.events.size(); i++) {
+    to.items.Add(from.items.events[i]);
+  }
+  to.next_page_token = from.next_page_token;
+  to.next_sync_token = from.next_sync_token;
+}
+
+// Local midnights worked out lately, by day: all day events are on a handful of days
+#define LOCAL_MIDNIGHT_CACHE_SIZE 4
+
+// Days since 1970-01-01 of a proleptic Gregorian date (month 1-12), for any year
+static int64_t DaysFromCivil(int64_t year, int month, int day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+static int DaysInMonth(int year, int month) {
+  static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  if (month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) {
+    return 29;
+  }
+  return days[month - 1];
+}
+
+// Reads count digits at p into value, false if they aren't all digits
+static bool ReadDigits(const char *p, const char *end, int count, int *value) {
+  if (end - p < count) {
+    return false;
+  }
+  *value = 0;
+  for (int i = 0; i < count; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      return false;
+    }
+    *value = *value * 10 + (p[i] - '0');
+  }
+  return true;
+}
+
+// Reads YYYY-MM-DD at p, false unless it is a valid date
+static bool ReadDate(const char *p, const char *end, int *year, int *month, int *day) {
+  return ReadDigits(p, end, 4, year) && end - p >= 10 && p[4] == '-' && p[7] == '-' &&
+      ReadDigits(p + 5, end, 2, month) && ReadDigits(p + 8, end, 2, day) &&
+      *month >= 1 && *month <= 12 && *day >= 1 && *day <= DaysInMonth(*year, *month);
+}
+
+/**
+ *  @brief: unix time of local midnight starting the day days after 1970-01-01. mktime looks
+ *          the time zone up again on every call, so the last few answers are kept (per thread:
+ *          the fetcher parses, the renderer may too). Assumes TZ doesn't change while running
+ */
+static int64_t LocalMidnight(int64_t days, int year, int month, int day) {
+  struct CachedMidnight {
+    int64_t days;
+    int64_t time;
+    bool valid;
+  };
+  static thread_local CachedMidnight cache[LOCAL_MIDNIGHT_CACHE_SIZE];
+  static thread_local unsigned int next;
+
+  for (int i = 0; i < LOCAL_MIDNIGHT_CACHE_SIZE; i++) {
+    if (cache[i].valid && cache[i].days == days) {
+      return cache[i].time;
+    }
+  }
+  struct tm midnight = {};
+  midnight.tm_year = year - 1900;
+  midnight.tm_mon = month - 1;
+  midnight.tm_mday = day;
+  midnight.tm_isdst = -1;
+  int64_t time = (int64_t) mktime(&midnight);
+
+  CachedMidnight &entry = cache[next++ % LOCAL_MIDNIGHT_CACHE_SIZE];
+  entry.days = days;
+  entry.time = time;
+  entry.valid = true;
+  return time;
+}
+
+/**
+ *  @brief: parses an RFC3339 time (date false) into unix time, or a date (date true) into
+ *          its local midnight. Returns false if value isn't one.
+ *          Times are YYYY-MM-DDThh:mm:ss, optional fractional seconds (dropped), then Z or the
+ *          offset from UTC as +hh:mm (or +hhmm, as strftime's %z writes it). Doesn't depend on
+ *          the locale, or on the local time zone except for dates
+ */
+bool ParseEventTime(const char *value, size_t length, bool date, int64_t *time) {
+  const char *p = value;
+  const char *end = value + length;
+  int year, month, day;
+  if (!ReadDate(p, end, &year, &month, &day)) {
+    return false;
+  }
+  p += 10;
+  int64_t days = DaysFromCivil(year, month, day);
+  if (date) {
+    if (p != end) {
+      return false;
+    }
+    *time = LocalMidnight(days, year, month, day);
+    return true;
+  }
+
+  int hour, minute, second;
+  if (end - p < 9 || (*p != 'T' && *p != 't' && *p != ' ') || p[3] != ':' || p[6] != ':' ||
+      !ReadDigits(p + 1, end, 2, &hour) || !ReadDigits(p + 4, end, 2, &minute) ||
+      !ReadDigits(p + 7, end, 2, &second) || hour > 23 || minute > 59 || second > 60) {
+    return false;
+  }
+  p += 9;
+  if (p < end && *p == '.') {
+    p++;
+    const char *digits = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+      p++;
+    }
+    if (p == digits) {
+      return false;
+    }
+  }
+
+  int offset = 0;
+  if (p < end && (*p == 'Z' || *p == 'z')) {
+    p++;
+  } else if (p < end && (*p == '+' || *p == '-')) {
+    int sign = *p == '-' ? -1 : 1;
+    int offset_hours, offset_minutes;
+    p++;
+    if (!ReadDigits(p, end, 2, &offset_hours)) {
+      return false;
+    }
+    p += 2;
+    if (p < end && *p == ':') {
+      p++;
+    }
+    if (!ReadDigits(p, end, 2, &offset_minutes) || offset_hours > 23 || offset_minutes > 59) {
+      return false;
+    }
+    p += 2;
+    offset = sign * (offset_hours * 3600 + offset_minutes * 60);
+  } else {
+    return false;
+  }
+  if (p != end) {
+    return false;
+  }
+
+  *time = days * 86400 + hour * 3600 + minute * 60 + second - offset;
+  return true;
+}
+
+// The parser reads the body once, front to back, keeping only what an Event holds: everything
+// else is skipped over as it comes, without being unescaped or stored
+
+// Where the parser is in the body
+struct Cursor {
+  const char *p;
+  const char *end;
+};
+
+static void SkipSpace(Cursor &c) {
+  while (c.p < c.end && (*c.p == ' ' || *c.p == '\t' || *c.p == '\n' || *c.p == '\r')) {
+    c.p++;
+  }
+}
+
+static bool Consume(Cursor &c, char token) {
+  SkipSpace(c);
+  if (c.p < c.end && *c.p == token) {
+    c.p++;
+    return true;
+  }
+  return false;
+}
+
+static bool ReadHex4(Cursor &c, uint32_t *value) {
+  if (c.end - c.p < 4) {
+    return false;
+  }
+  *value = 0;
+  for (int i = 0; i < 4; i++) {
+    char h = *c.p++;
+    *value <<= 4;
+    if (h >= '0' && h <= '9') {
+      *value |= h - '0';
+    } else if (h >= 'a' && h <= 'f') {
+      *value |= h - 'a' + 10;
+    } else if (h >= 'A' && h <= 'F') {
+      *value |= h - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void AppendUtf8(std::string &out, uint32_t code_point) {
+  if (code_point < 0x80) {
+    out += (char) code_point;
+  } else if (code_point < 0x800) {
+    out += (char) (0xC0 | (code_point >> 6));
+    out += (char) (0x80 | (code_point & 0x3F));
+  } else if (code_point < 0x10000) {
+    out += (char) (0xE0 | (code_point >> 12));
+    out += (char) (0x80 | ((code_point >> 6) & 0x3F));
+    out += (char) (0x80 | (code_point & 0x3F));
+  } else {
+    out += (char) (0xF0 | (code_point >> 18));
+    out += (char) (0x80 | ((code_point >> 12) & 0x3F));
+    out += (char) (0x80 | ((code_point >> 6) & 0x3F));
+    out += (char) (0x80 | (code_point & 0x3F));
+  }
+}
+
+// Reads a string value into out, unescaped. out is reused, so it rarely needs to grow
+static bool ParseString(Cursor &c, std::string &out) {
+  if (!Consume(c, '"')) {
+    return false;
+  }
+  out.clear();
+  while (c.p < c.end) {
+    const char *run = c.p;
+    while (c.p < c.end && *c.p != '"' && *c.p != '\\') {
+      c.p++;
+    }
+    out.append(run, c.p - run);
+    if (c.p + 1 >= c.end) {
+      return c.p < c.end && *c.p++ == '"';
+    }
+    if (*c.p++ == '"') {
+      return true;
+    }
+    char escaped = *c.p++;
+    switch (escaped) {
+      case '"': case '\\': case '/': out += escaped; break;
+      case 'b': out += '\b'; break;
+      case 'f': out += '\f'; break;
+      case 'n': out += '\n'; break;
+      case 'r': out += '\r'; break;
+      case 't': out += '\t'; break;
+      case 'u': {
+        uint32_t code_point;
+        if (!ReadHex4(c, &code_point)) {
+          return false;
+        }
+        if (code_point >= 0xD800 && code_point < 0xDC00 &&
+            c.end - c.p >= 6 && c.p[0] == '\\' && c.p[1] == 'u') {
+          // Surrogate pair
+          c.p += 2;
+          uint32_t low;
+          if (!ReadHex4(c, &low)) {
+            return false;
+          }
+          if (low >= 0xDC00 && low < 0xE000) {
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+          } else {
+            AppendUtf8(out, 0xFFFD);
+            code_point = (low >= 0xD800 && low < 0xE000) ? 0xFFFD : low;
+          }
+        } else if (code_point >= 0xD800 && code_point < 0xE000) {
+          code_point = 0xFFFD;
+        }
+        AppendUtf8(out, code_point);
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+// Reads a member name into key, or an empty one if it's too long or escaped to be one we want
+static bool ParseKey(Cursor &c, char *key) {
+  if (!Consume(c, '"')) {
+    return false;
+  }
+  size_t length = 0;
+  bool usable = true;
+  while (c.p < c.end && *c.p != '"') {
+    if (*c.p == '\\') {
+      usable = false;
+      c.p++;
+    } else if (length + 1 < MAX_KEY_LENGTH) {
+      key[length++] = *c.p;
+    } else {
+      usable = false;
+    }
+    c.p++;
+  }
+  key[usable ? length : 0] = '\0';
+  if (c.p >= c.end) {
+    return false;
+  }
+  c.p++;
+  return Consume(c, ':');
+}
+
+static bool SkipValue(Cursor &c, int depth) {
+  SkipSpace(c);
+  if (c.p >= c.end || depth > MAX_SKIP_DEPTH) {
+    return false;
+  }
+  if (*c.p == '"') {
+    for (c.p++; c.p < c.end && *c.p != '"'; c.p++) {
+      if (*c.p == '\\') {
+        c.p++;
+      }
+    }
+    if (c.p >= c.end) {
+      return false;
+    }
+    c.p++;
+    return true;
+  }
+  if (*c.p == '{' || *c.p == '[') {
+    bool object = *c.p == '{';
+    char close = object ? '}' : ']';
+    c.p++;
+    if (Consume(c, close)) {
+      return true;
+    }
+    do {
+      if (object && (!SkipValue(c, depth + 1) || !Consume(c, ':'))) {
+        return false;
+      }
+      if (!SkipValue(c, depth + 1)) {
+        return false;
+      }
+    } while (Consume(c, ','));
+    return Consume(c, close);
+  }
+  // Number, true, false, null
+  const char *start = c.p;
+  while (c.p < c.end && (isalnum((unsigned char) *c.p) || *c.p == '-' || *c.p == '+' || *c.p == '.')) {
+    c.p++;
+  }
+  return c.p > start;
+}
+
+// Parses an object, calling member(key) with the cursor on each member's value, which member
+// has to consume. An empty key is one nobody wants
+template <typename Member>
+static bool ParseObject(Cursor &c, Member member) {
+  char key[MAX_KEY_LENGTH];
+  if (!Consume(c, '{')) {
+    return false;
+  }
+  if (Consume(c, '}')) {
+    return true;
+  }
+  do {
+    if (!ParseKey(c, key) || !member(key)) {
+      return false;
+    }
+  } while (Consume(c, ','));
+  return Consume(c, '}');
+}
+
+// Parses an array, calling element(index) with the cursor on each element, which element
+// has to consume
+template <typename Element>
+static bool ParseArray(Cursor &c, Element element) {
+  if (!Consume(c, '[')) {
+    return false;
+  }
+  if (Consume(c, ']')) {
+    return true;
+  }
+  size_t index = 0;
+  do {
+    if (!element(index++)) {
+      return false;
+    }
+  } while (Consume(c, ','));
+  return Consume(c, ']');
+}
+
+static EventStatus ResponseStatus(const std::string &status) {
+  if (status == "accepted") {
+    return EVENT_ACCEPTED;
+  } else if (status == "tentative") {
+    return EVENT_TENTATIVE;
+  } else if (status == "needsAction") {
+    return EVENT_NEEDS_ACTION;
+  } else if (status == "declined") {
+    return EVENT_DECLINED;
+  }
+  return EVENT_UNKNOWN;
+}
+
+// Parses a start or end: {"dateTime": ...} or, for all day events, {"date": ...}
+static bool ParseTimeMember(Cursor &c, std::string &scratch, int64_t *time, uint8_t *flags) {
+  return ParseObject(c, [&](const char *key) {
+    bool date = strcmp(key, "date") == 0;
+    if (!date && strcmp(key, "dateTime") != 0) {
+      return SkipValue(c, 0);
+    }
+    if (!ParseString(c, scratch)) {
+      return false;
+    }
+    if (date) {
+      *flags |= EVENT_ALL_DAY;
+    }
+    ParseEventTime(scratch.data(), scratch.size(), date, time);
+    return true;
+  });
+}
+
+static bool ParseEvent(Cursor &c, std::string &scratch, EventList &list) {
+  Event event;
+  memset(&event, 0, sizeof event);
+  event.status = EVENT_OWN;
+  event.summary = list.strings.Intern("", 0);
+
+  bool parsed = ParseObject(c, [&](const char *key) {
+    if (strcmp(key, "id") == 0 || strcmp(key, "summary") == 0 || strcmp(key, "location") == 0) {
+      if (!ParseString(c, scratch)) {
+        return false;
+      }
+      const char *interned = list.strings.Intern(scratch.data(), scratch.size());
+      if (key[0] == 'i') {
+        event.id = interned;
+      } else if (key[0] == 's') {
+        event.summary = interned;
+      } else {
+        event.location = interned;
+      }
+      return true;
+    }
+    if (strcmp(key, "status") == 0) {
+      if (!ParseString(c, scratch)) {
+        return false;
+      }
+      if (scratch == "cancelled") {
+        event.flags |= EVENT_CANCELLED;
+      }
+      return true;
+    }
+    if (strcmp(key, "recurringEventId") == 0) {
+      event.flags |= EVENT_RECURRING;
+      return SkipValue(c, 0);
+    }
+    if (strcmp(key, "start") == 0) {
+      return ParseTimeMember(c, scratch, &event.start, &event.flags);
+    }
+    if (strcmp(key, "end") == 0) {
+      return ParseTimeMember(c, scratch, &event.end, &event.flags);
+    }
+    if (strcmp(key, "attendees") == 0) {
+      // Only the first attendee's response counts (requests ask for one anyway)
+      event.status = EVENT_UNKNOWN;
+      return ParseArray(c, [&](size_t index) {
+        if (index > 0) {
+          return SkipValue(c, 0);
+        }
+        return ParseObject(c, [&](const char *attendee_key) {
+          if (strcmp(attendee_key, "responseStatus") != 0) {
+            return SkipValue(c, 0);
+          }
+          if (!ParseString(c, scratch)) {
+            return false;
+          }
+          event.status = ResponseStatus(scratch);
+          return true;
+        });
+      });
+    }
+    return SkipValue(c, 0);
+  });
+  if (!parsed || event.id == NULL) {
+    return false;
+  }
+  list.events.push_back(event);
+  return true;
+}
+
+/**
+ *  @brief: parses an event list response (body, length bytes) into page, keeping only what
+ *          Event holds. Returns false if the body isn't valid, page then holds what was read
+ */
+bool ParseEventPage(const char *body, size_t length, EventPage &page) {
+  page.items.Clear();
+  page.next_page_token.clear();
+  page.next_sync_token.clear();
+  std::string scratch;
+
+  Cursor c = { body, body + length };
+  bool parsed = ParseObject(c, [&](const char *key) {
+    if (strcmp(key, "items") == 0) {
+      return ParseArray(c, [&](size_t) {
+        return ParseEvent(c, scratch, page.items);
+      });
+    }
+    if (strcmp(key, "nextPageToken") == 0) {
+      return ParseString(c, page.next_page_token);
+    }
+    if (strcmp(key, "nextSyncToken") == 0) {
+      return ParseString(c, page.next_sync_token);
+    }
+    return SkipValue(c, 0);
+  });
+  SkipSpace(c);
+  return parsed && c.p == c.end;
+}
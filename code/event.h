@@ -0,0 +1,85 @@
+/**
+ *  @filename   :   event.h
+ *  @brief      :   Header file for the compact calendar Event, and the parser that fills it
+ *                  straight from an event list response
+ *  
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// How the calendar's owner responded, lower is more important (see is_more_important_event)
+enum EventStatus {
+    EVENT_ACCEPTED = 0,
+    EVENT_OWN = 1,              // no attendees: the owner's own event
+    EVENT_TENTATIVE = 2,
+    EVENT_NEEDS_ACTION = 3,
+    EVENT_DECLINED = 4,
+    EVENT_UNKNOWN = 99
+};
+
+// Event flags
+#define EVENT_ALL_DAY   0x01    // start and end are dates: local midnight
+#define EVENT_RECURRING 0x02    // an instance of a recurring event
+#define EVENT_CANCELLED 0x04    // deleted, only seen in sync deltas
+
+// Strings are interned in the StringPool of the list the event belongs to
+struct Event {
+    int64_t start;              // unix time
+    int64_t end;
+    const char *id;
+    const char *summary;
+    const char *location;       // NULL if there is none
+    uint8_t status;             // EventStatus
+    uint8_t flags;
+};
+
+// Each distinct string once; the pointers it hands out stay valid until Clear
+class StringPool {
+public:
+    const char * Intern(const char *s, size_t length);
+    const char * Intern(const char *s);
+    void Clear(void);
+
+private:
+    std::unordered_set<std::string> strings;
+};
+
+// Events along with the strings they point to. Not copyable, as the pointers would still
+// point into the original: Add copies events over, strings and all
+class EventList {
+public:
+    EventList();
+    EventList(EventList &&other) = default;
+    EventList& operator=(EventList &&other) = default;
+
+    void Add(const Event &event);
+    void Clear(void);
+    bool Same(const EventList &other) const;
+
+    StringPool strings;
+    std::vector<Event> events;
+
+private:
+    EventList(const EventList&);
+    EventList& operator=(const EventList&);
+};
+
+// One page of an event list
+struct EventPage {
+    EventList items;
+    std::string next_page_token;
+    std::string next_sync_token;
+};
+
+bool ParseEventPage(const char *body, size_t length, EventPage &page);
+void CopyEventPage(const EventPage &from, EventPage &to);
+bool ParseEventTime(const char *value, size_t length, bool date, int64_t *time);
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ *  @filename   :   fetcher.cpp
+ *  @brief      :   Fetches calendar events on a thread of its own, see fetcher.h
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <iostream>
+#include <system_error>
+#include "fetcher.h"
+
+EventFetcher::EventFetcher() : latest(NULL) {
+  gcal = NULL;
+  fetch = NULL;
+  interval_s = 0;
+  wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+EventFetcher::~EventFetcher() {
+  Stop();
+  delete latest.exchange(NULL);
+  if (wakeup_fd >= 0) {
+    close(wakeup_fd);
+  }
+  if (stop_fd >= 0) {
+    close(stop_fd);
+  }
+}
+
+/**
+ *  @brief: starts fetching, right away and then every interval_s. Returns false if the
+ *          thread couldn't be started
+ */
+bool EventFetcher::Start(GoogleCalendar *gcal, FetchEvents fetch, int interval_s) {
+  if (wakeup_fd < 0 || stop_fd < 0 || thread.joinable()) {
+    return false;
+  }
+  this->gcal = gcal;
+  this->fetch = fetch;
+  this->interval_s = interval_s;
+  try {
+    thread = std::thread(&EventFetcher::Run, this);
+  } catch (const std::system_error &e) {
+    cout << "Could not start the event fetcher: " << e.what() << endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ *  @brief: stops fetching, waiting for a fetch in progress to finish
+ */
+void EventFetcher::Stop(void) {
+  if (!thread.joinable()) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(stop_fd, &one, sizeof one) != sizeof one) {
+    printf("Could not stop the event fetcher: %s\n", strerror(errno));
+    return;
+  }
+  thread.join();
+}
+
+/**
+ *  @brief: the latest snapshot, if one was published since the last call, NULL otherwise.
+ *          The caller owns the snapshot and deletes it. Never blocks
+ */
+const EventSnapshot * EventFetcher::TakeLatest(void) {
+  uint64_t published;
+  if (read(wakeup_fd, &published, sizeof published) < 0 && errno != EAGAIN) {
+    printf("Reading the event fetcher's wakeup failed: %s\n", strerror(errno));
+  }
+  return latest.exchange(NULL, std::memory_order_acquire);
+}
+
+/**
+ *  @brief: an fd that polls readable when TakeLatest has a snapshot to return
+ */
+int EventFetcher::WakeupFd(void) const {
+  return wakeup_fd;
+}
+
+void EventFetcher::Publish(EventSnapshot *snapshot) {
+  // A snapshot the renderer hasn't taken yet is out of date now
+  delete latest.exchange(snapshot, std::memory_order_acq_rel);
+  uint64_t one = 1;
+  if (write(wakeup_fd, &one, sizeof one) != sizeof one) {
+    printf("Waking up the renderer failed: %s\n", strerror(errno));
+  }
+}
+
+void EventFetcher::Run(void) {
+  EventList previous;
+  bool published = false;
+  while (true) {
+    EventSnapshot *snapshot = new EventSnapshot;
+    bool fetched = false;
+    try {
+      fetched = fetch(gcal, snapshot->events);
+    } catch (const std::exception &e) {
+      cout << "Fetching events failed: " << e.what() << endl;
+    }
+    // If the request failed, keep showing what we had. Unchanged events don't need
+    // drawing again either
+    if (fetched && (!published || !snapshot->events.Same(previous))) {
+      // The snapshot is the renderer's once published: keep a copy to compare with
+      previous.Clear();
+      for (size_t i = 0; i < snapshot->events.events.size(); i++) {
+        previous.Add(snapshot->events.events[i]);
+      }
+      snapshot->fetched_at = time(0);
+      Publish(snapshot);
+      published = true;
+    } else {
+      delete snapshot;
+    }
+
+    struct pollfd stop = { stop_fd, POLLIN, 0 };
+    int ready = poll(&stop, 1, interval_s * 1000);
+    if (ready > 0) {
+      return;
+    }
+    if (ready < 0 && errno != EINTR) {
+      printf("Event fetcher wait failed: %s\n", strerror(errno));
+      sleep(interval_s);
+    }
+  }
+}
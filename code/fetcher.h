@@ -0,0 +1,56 @@
+/**
+ *  @filename   :   fetcher.h
+ *  @brief      :   Header file for EventFetcher, which fetches calendar events off the render loop
+ *  
+ */
+
+#ifndef FETCHER_H
+#define FETCHER_H
+
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include "gcal.h"
+
+// Events as fetched at fetched_at. Once published, a snapshot is never modified: the renderer
+// can hold on to it for as long as it likes
+struct EventSnapshot {
+    EventList events;
+    time_t fetched_at;
+};
+
+// Fetches the events into events (on the fetcher's thread, the only one to use the
+// GoogleCalendar). Returns false if that failed
+typedef bool (*FetchEvents)(GoogleCalendar *gcal, EventList &events);
+
+// Fetches events every interval_s on a thread of its own, and hands the renderer a snapshot
+// whenever they change. Only the latest snapshot is kept: a new one replaces one not taken yet
+class EventFetcher {
+public:
+    EventFetcher();
+    ~EventFetcher();
+
+    bool Start(GoogleCalendar *gcal, FetchEvents fetch, int interval_s);
+    void Stop(void);
+    const EventSnapshot * TakeLatest(void);
+    int WakeupFd(void) const;
+
+private:
+    EventFetcher(const EventFetcher&);
+    EventFetcher& operator=(const EventFetcher&);
+
+    void Run(void);
+    void Publish(EventSnapshot *snapshot);
+
+    GoogleCalendar *gcal;
+    FetchEvents fetch;
+    int interval_s;
+    std::thread thread;
+    // Single producer (the thread), single consumer (TakeLatest)
+    std::atomic<EventSnapshot *> latest;
+    // eventfds: readable when a snapshot is published, resp. when Stop wants the thread gone
+    int wakeup_fd;
+    int stop_fd;
+};
+
+#endif
@@ -0,0 +1,257 @@
+/**
+ *  @filename   :   frameops.cpp
+ *  @brief      :   Pixel kernels used to compare and convert 1-bit frames
+ */
+
+#include <string.h>
+#include <algorithm>    // std::min
+#include <limits.h>     // LONG_MAX
+#include "frameops.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/**
+ *  Cairo A1 packs pixels into 32-bit words, first pixel in the least significant bit, and uses
+ *  1 for ink. The panel wants bytes with the first pixel in the most significant bit, and 0 for ink.
+ *  On a little-endian machine both orders put the same 8 pixels in the same byte, so converting
+ *  is a per-byte bit reversal plus inversion. On big-endian, only the inversion is needed.
+ */
+struct CairoA1ToPanelTable {
+  unsigned char map[256];
+
+  CairoA1ToPanelTable() {
+    for (unsigned int b = 0; b < 256; b++) {
+      unsigned int out = b;
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+      out = 0;
+      for (int bit = 0; bit < 8; bit++) {
+        out |= ((b >> bit) & 1) << (7 - bit);
+      }
+#endif
+      map[b] = out ^ 0xFF;
+    }
+  }
+};
+
+static const CairoA1ToPanelTable cairo_a1_to_panel;
+
+static inline uint64_t LoadWord(const unsigned char *p) {
+  // memcpy keeps unaligned loads legal, and compiles down to a plain load
+  uint64_t word;
+  memcpy(&word, p, sizeof word);
+  return word;
+}
+
+// Offset of the lowest-addressed non-zero byte of a word, and the bit position of a byte offset
+static inline unsigned int FirstByte(uint64_t diff) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return __builtin_clzll(diff) / 8;
+#else
+  return __builtin_ctzll(diff) / 8;
+#endif
+}
+
+static inline unsigned int ByteShift(unsigned int offset) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return 8 * (7 - offset);
+#else
+  return 8 * offset;
+#endif
+}
+
+/**
+ *  @brief: true if the first len bytes of a and b are identical
+ */
+static inline bool RowsEqual(const unsigned char *a, const unsigned char *b, unsigned int len) {
+  unsigned int i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint8x16_t acc = vdupq_n_u8(0);
+  for (; i + 16 <= len; i += 16) {
+    acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+  }
+  uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+  if ((vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) != 0) {
+    return false;
+  }
+#endif
+  uint64_t acc_word = 0;
+  for (; i + 8 <= len; i += 8) {
+    acc_word |= LoadWord(a + i) ^ LoadWord(b + i);
+  }
+  for (; i < len; i++) {
+    acc_word |= a[i] ^ b[i];
+  }
+  return acc_word == 0;
+}
+
+/**
+ *  @brief: the most spans a width x height frame can have when rows are split at runs of
+ *          split_bytes clean bytes: one changed byte, then split_bytes clean ones, over and over.
+ *          For sizing span and rect vectors once, up front
+ */
+size_t MaxFrameSpans(unsigned int width, unsigned int height, unsigned int split_bytes) {
+  return (size_t) height * ((width / 8 + split_bytes) / (split_bytes + 1));
+}
+
+/**
+ *  @brief: compares two frames of height rows, each row_bytes wide and stride bytes apart,
+ *          and appends one DirtySpan per run of changed bytes to spans. Runs are only split
+ *          at more than gap_bytes unchanged bytes. Returns the number of changed pixels
+ */
+unsigned int DiffFrames(const unsigned char *old_frame, const unsigned char *new_frame,
+                        unsigned int row_bytes, unsigned int stride, unsigned int height,
+                        unsigned int gap_bytes, std::vector<DirtySpan> &spans) {
+  unsigned int total_changed = 0;
+  spans.clear();
+
+  for (unsigned int row = 0; row < height; row++) {
+    const unsigned char *a = old_frame + row * stride;
+    const unsigned char *b = new_frame + row * stride;
+    if (RowsEqual(a, b, row_bytes)) {
+      continue;
+    }
+
+    bool open = false;
+    DirtySpan span = { (uint16_t) row, 0, 0, 0 };
+    unsigned int col = 0;
+    while (col < row_bytes) {
+      // Next word (or the row's tail), as a difference mask
+      unsigned int len = row_bytes - col < 8 ? row_bytes - col : 8;
+      uint64_t diff;
+      if (len == 8) {
+        diff = LoadWord(a + col) ^ LoadWord(b + col);
+      } else {
+        unsigned char tail_a[8] = { 0 };
+        unsigned char tail_b[8] = { 0 };
+        memcpy(tail_a, a + col, len);
+        memcpy(tail_b, b + col, len);
+        diff = LoadWord(tail_a) ^ LoadWord(tail_b);
+      }
+
+      // Walk the changed bytes of the word, growing or splitting the open span
+      while (diff != 0) {
+        unsigned int offset = FirstByte(diff);
+        uint64_t byte_mask = (uint64_t) 0xFF << ByteShift(offset);
+        unsigned int changed = __builtin_popcountll(diff & byte_mask);
+        unsigned int i = col + offset;
+        diff &= ~byte_mask;
+        total_changed += changed;
+
+        if (open && i > span.last + gap_bytes + 1) {
+          spans.push_back(span);
+          open = false;
+        }
+        if (!open) {
+          span.first = i;
+          span.changed_pixels = 0;
+          open = true;
+        }
+        span.last = i;
+        span.changed_pixels += changed;
+      }
+      col += len;
+    }
+    if (open) {
+      spans.push_back(span);
+    }
+  }
+  return total_changed;
+}
+
+/**
+ *  @brief: converts bytes bytes of cairo A1 data (e.g. one row, without the stride padding)
+ *          into panel format. cairo_data and panel_data may be the same buffer
+ */
+void ConvertCairoA1ToPanel(const unsigned char *cairo_data, unsigned char *panel_data, unsigned int bytes) {
+  unsigned int i = 0;
+#if defined(__aarch64__) && __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+  // RBIT reverses the bits of each byte, 16 at a time
+  for (; i + 16 <= bytes; i += 16) {
+    vst1q_u8(panel_data + i, vmvnq_u8(vrbitq_u8(vld1q_u8(cairo_data + i))));
+  }
+#endif
+  ConvertCairoA1ToPanelGeneric(cairo_data + i, panel_data + i, bytes - i);
+}
+
+/**
+ *  @brief: ConvertCairoA1ToPanel with the lookup table only, as on machines without RBIT
+ */
+void ConvertCairoA1ToPanelGeneric(const unsigned char *cairo_data, unsigned char *panel_data, unsigned int bytes) {
+  unsigned int i = 0;
+  const unsigned char *map = cairo_a1_to_panel.map;
+  for (; i + 8 <= bytes; i += 8) {
+    panel_data[i] = map[cairo_data[i]];
+    panel_data[i + 1] = map[cairo_data[i + 1]];
+    panel_data[i + 2] = map[cairo_data[i + 2]];
+    panel_data[i + 3] = map[cairo_data[i + 3]];
+    panel_data[i + 4] = map[cairo_data[i + 4]];
+    panel_data[i + 5] = map[cairo_data[i + 5]];
+    panel_data[i + 6] = map[cairo_data[i + 6]];
+    panel_data[i + 7] = map[cairo_data[i + 7]];
+  }
+  for (; i < bytes; i++) {
+    panel_data[i] = map[cairo_data[i]];
+  }
+}
+
+DirtyRect UnionRect(const DirtyRect &a, const DirtyRect &b) {
+  DirtyRect u;
+  u.x = std::min(a.x, b.x);
+  u.y = std::min(a.y, b.y);
+  u.width = std::max(a.x + a.width, b.x + b.width) - u.x;
+  u.height = std::max(a.y + a.height, b.y + b.height) - u.y;
+  return u;
+}
+
+bool RectsOverlap(const DirtyRect &a, const DirtyRect &b) {
+  return a.x < b.x + b.width && b.x < a.x + a.width &&
+    a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+bool RectContains(const DirtyRect &outer, const DirtyRect &inner) {
+  return outer.x <= inner.x && inner.x + inner.width <= outer.x + outer.width &&
+    outer.y <= inner.y && inner.y + inner.height <= outer.y + outer.height;
+}
+
+/**
+ *  @brief: merges rectangles that overlap, or that are cheaper to refresh as one window than
+ *          separately, until they're disjoint and there are at most max_rects. A window costs
+ *          window_cost_us, plus byte_cost_us for each byte inside it
+ */
+void MergeRects(std::vector<DirtyRect> &rects, unsigned long window_cost_us, unsigned long byte_cost_us,
+                size_t max_rects) {
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    // Pick the pair whose merge saves the most (or costs the least, if we have too many windows)
+    size_t bestA = 0;
+    size_t bestB = 0;
+    long bestSaving = 0;
+    bool found = false;
+    for (size_t a = 0; a < rects.size(); a++) {
+      for (size_t b = a + 1; b < rects.size(); b++) {
+        DirtyRect u = UnionRect(rects[a], rects[b]);
+        long extraBytes = (long) (u.width / 8 * u.height) -
+          (long) (rects[a].width / 8 * rects[a].height) - (long) (rects[b].width / 8 * rects[b].height);
+        long saving = (long) window_cost_us - extraBytes * (long) byte_cost_us;
+        bool mustMerge = RectsOverlap(rects[a], rects[b]);
+        if (mustMerge) {
+          saving = LONG_MAX;
+        }
+        if (!found || saving > bestSaving) {
+          bestA = a;
+          bestB = b;
+          bestSaving = saving;
+          found = true;
+        }
+      }
+    }
+    if (found && (bestSaving >= 0 || rects.size() > max_rects)) {
+      rects[bestA] = UnionRect(rects[bestA], rects[bestB]);
+      rects.erase(rects.begin() + bestB);
+      merged = true;
+    }
+  }
+}
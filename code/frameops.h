@@ -0,0 +1,43 @@
+/**
+ *  @filename   :   frameops.h
+ *  @brief      :   Header file for the pixel kernels used to compare and convert 1-bit frames
+ *  
+ */
+
+#ifndef FRAMEOPS_H
+#define FRAMEOPS_H
+
+#include <stdint.h>
+#include <vector>
+
+// A run of changed bytes within one row of a frame: byte columns first..last, inclusive
+struct DirtySpan {
+    uint16_t row;
+    uint16_t first;
+    uint16_t last;
+    uint16_t changed_pixels;
+};
+
+// A region of the screen in pixels; x and width are always multiples of 8
+struct DirtyRect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+unsigned int DiffFrames(const unsigned char *old_frame, const unsigned char *new_frame,
+                        unsigned int row_bytes, unsigned int stride, unsigned int height,
+                        unsigned int gap_bytes, std::vector<DirtySpan> &spans);
+size_t MaxFrameSpans(unsigned int width, unsigned int height, unsigned int split_bytes);
+
+void ConvertCairoA1ToPanel(const unsigned char *cairo_data, unsigned char *panel_data, unsigned int bytes);
+void ConvertCairoA1ToPanelGeneric(const unsigned char *cairo_data, unsigned char *panel_data, unsigned int bytes);
+
+DirtyRect UnionRect(const DirtyRect &a, const DirtyRect &b);
+bool RectsOverlap(const DirtyRect &a, const DirtyRect &b);
+bool RectContains(const DirtyRect &outer, const DirtyRect &inner);
+void MergeRects(std::vector<DirtyRect> &rects, unsigned long window_cost_us, unsigned long byte_cost_us,
+                size_t max_rects);
+
+#endif
@@ -7,6 +7,11 @@
 #include <stdlib.h>
 #include <iostream>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
 #include "restclient-cpp/connection.h"
 #include "restclient-cpp/restclient.h"
 
@@ -18,6 +23,28 @@ const string API_BASE_URL = "https://www.googleapis.com/calendar/v3";
 const string AUTH_BASE_URL = "https://accounts.google.com/o/oauth2/auth";
 const string TOKEN_URL = "https://accounts.google.com/o/oauth2/token";
 const string REDIRECT_URI = "urn:ietf:wg:oauth:2.0:oob";
+// The parts of an event main.cpp reads (summary, location, start, end, status, recurringEventId,
+// the first attendee's responseStatus), and id for syncing. Event lists only return these,
+// instead of descriptions, conference data, attachments, reminders and so on
+const string EVENT_LIST_FIELDS = "items(id,status,summary,location,start(date,dateTime),end(date,dateTime),"
+  "recurringEventId,attendees(responseStatus)),nextPageToken,nextSyncToken";
+
+// Percent-encodes everything but unreserved characters, for query parameter values
+static string UrlEncode(const string &value) {
+  static const char *hex = "0123456789ABCDEF";
+  string encoded;
+  for (size_t i = 0; i < value.size(); i++) {
+    unsigned char c = value[i];
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      encoded += c;
+    } else {
+      encoded += '%';
+      encoded += hex[c >> 4];
+      encoded += hex[c & 0xF];
+    }
+  }
+  return encoded;
+}
 
 GoogleCalendar::GoogleCalendar() {
   string authToken;
@@ -28,6 +55,7 @@ GoogleCalendar::GoogleCalendar() {
   //curl_global_init(CURL_GLOBAL_DEFAULT);
   RestClient::init();
   gcalApiConnection = new RestClient::Connection(API_BASE_URL);
+  requestCount = 0;
 };
 
 void GoogleCalendar::SetCredentials(string newClientID, string newClientSecret) {
@@ -129,25 +157,161 @@ void GoogleCalendar::RequestInstalledAppToken() {
   GetInstalledAppTokenForCode(accessCode);
 }
 
-json GoogleCalendar::GetEventsBetween(string calendarID, string timeMin, string timeMax) {
-  string eventPath = "/calendars/" + calendarID + "/events"; 
-  eventPath += "?orderBy=startTime";
-  eventPath += "&singleEvents=true";
-  eventPath += "&timeMin=" + timeMin;
-  eventPath += "&timeMax=" + timeMax;
+/**
+ *  Events between timeMin and timeMax (expanded into single events), kept in sync incrementally:
+ *  the first call lists them all, later ones only fetch what changed since, with the sync token
+ *  the last list ended with. A different window (e.g. the next day), or a token Google no longer
+ *  accepts (410 Gone), starts over with a full list. Returns false if that failed
+ */
+bool GoogleCalendar::SyncEventsBetween(string calendarID, string timeMin, string timeMax, EventList &events) {
+  string eventPath = "/calendars/" + calendarID + "/events";
+  eventPath += "?singleEvents=true";
   eventPath += "&maxAttendees=1";
+  eventPath += "&maxResults=" + to_string(EVENTS_PAGE_SIZE);
+  eventPath += "&fields=" + UrlEncode(EVENT_LIST_FIELDS);
 
-  cout << "Events from: " << timeMin;
+  int code = 0;
+  if (!syncToken.empty() && calendarID == syncCalendarID && timeMin == syncTimeMin && timeMax == syncTimeMax) {
+    // Changes are applied to the events as they are: upserts and cancellations alike are
+    // safe to apply again, if a later page fails and the same changes come back next time
+    if (ListEvents(eventPath + "&syncToken=" + UrlEncode(syncToken), syncStrings, syncedEvents, &code)) {
+      SyncedEvents(events);
+      return true;
+    }
+    if (code != 410) {
+      return false;
+    }
+    cout << "Sync token expired, listing all events again" << endl;
+  }
+
+  // Google doesn't take orderBy or a time window along with a sync token, so the initial list
+  // doesn't order either: SyncedEvents sorts, and drops changes outside the window
+  cout << "Syncing events from: " << timeMin;
   cout << " to: " << timeMax << endl;
+  syncToken.clear();
+  StringPool strings;
+  map<string, Event> listed;
+  // The offsets' '+' would otherwise reach Google as a space
+  string windowPath = eventPath + "&timeMin=" + UrlEncode(timeMin) + "&timeMax=" + UrlEncode(timeMax);
+  if (!ListEvents(windowPath, strings, listed, &code)) {
+    return false;
+  }
+  syncCalendarID = calendarID;
+  syncTimeMin = timeMin;
+  syncTimeMax = timeMax;
+  syncedEvents.swap(listed);
+  swap(syncStrings, strings);
+  SyncedEvents(events);
+  return true;
+}
 
-  json data = MakeGetRequest(eventPath);
+/**
+ *  Applies every page of the event list at path to events (their strings interned in strings),
+ *  and keeps the sync token it ends with. Returns false (with the HTTP status in code) if a
+ *  page failed
+ */
+bool GoogleCalendar::ListEvents(string path, StringPool &strings, map<string, Event> &events, int *code) {
+  EventPage page;
+  string pageToken;
+  do {
+    string pagePath = path;
+    if (!pageToken.empty()) {
+      pagePath += "&pageToken=" + UrlEncode(pageToken);
+    }
+    if (!GetEventPage(pagePath, page, code)) {
+      return false;
+    }
+    for (size_t i = 0; i < page.items.events.size(); i++) {
+      Event event = page.items.events[i];
+      if (event.flags & EVENT_CANCELLED) {
+        events.erase(event.id);
+        continue;
+      }
+      event.id = strings.Intern(event.id);
+      event.summary = strings.Intern(event.summary);
+      event.location = strings.Intern(event.location);
+      events[event.id] = event;
+    }
+    pageToken = page.next_page_token;
+    if (pageToken.empty()) {
+      syncToken = page.next_sync_token;
+    }
+  } while (!pageToken.empty());
+  return true;
+}
 
-  return data["items"];
+/**
+ *  The synced events that overlap the window, ordered by start time, into events
+ */
+void GoogleCalendar::SyncedEvents(EventList &events) {
+  int64_t windowStart = 0;
+  int64_t windowEnd = 0;
+  ParseEventTime(syncTimeMin.data(), syncTimeMin.size(), false, &windowStart);
+  ParseEventTime(syncTimeMax.data(), syncTimeMax.size(), false, &windowEnd);
+  vector<const Event *> ordered;
+  for (map<string, Event>::const_iterator e = syncedEvents.begin(); e != syncedEvents.end(); ++e) {
+    if (e->second.end > windowStart && e->second.start < windowEnd) {
+      ordered.push_back(&e->second);
+    }
+  }
+  stable_sort(ordered.begin(), ordered.end(), [](const Event *a, const Event *b) {
+    return a->start < b->start;
+  });
+
+  events.Clear();
+  for (size_t i = 0; i < ordered.size(); i++) {
+    events.Add(*ordered[i]);
+  }
 }
 
-json GoogleCalendar::MakeGetRequest(string path) {
+// The response's ETag header, empty if it has none (HTTP/2 has header names in lowercase)
+static string ResponseETag(const RestClient::Response &r) {
+  for (RestClient::HeaderFields::const_iterator h = r.headers.begin(); h != r.headers.end(); ++h) {
+    if (strcasecmp(h->first.c_str(), "ETag") == 0) {
+      return h->second;
+    }
+  }
+  return string();
+}
+
+/**
+ *  The entry of cache to keep path's page in, if the response has an ETag (NULL otherwise),
+ *  making room by dropping the least recently used page once there are GET_CACHE_MAX_ENTRIES
+ */
+static CachedEventPage * CacheEntry(map<string, CachedEventPage> &cache, const string &path,
+                                    const RestClient::Response &r, unsigned long now) {
+  string etag = ResponseETag(r);
+  if (etag.empty()) {
+    cache.erase(path);
+    return NULL;
+  }
+
+  if (cache.size() >= GET_CACHE_MAX_ENTRIES && cache.find(path) == cache.end()) {
+    map<string, CachedEventPage>::iterator oldest = cache.begin();
+    for (map<string, CachedEventPage>::iterator c = cache.begin(); c != cache.end(); ++c) {
+      if (c->second.last_used < oldest->second.last_used) {
+        oldest = c;
+      }
+    }
+    cache.erase(oldest);
+  }
+  CachedEventPage &entry = cache[path];
+  entry.etag = etag;
+  entry.last_used = now;
+  return &entry;
+}
+
+/**
+ *  GETs path from the API, with If-None-Match: etag unless it's empty. Refreshes the auth
+ *  token and tries again if it was refused
+ */
+RestClient::Response GoogleCalendar::Get(const string &path, const string &etag) {
+  requestCount++;
   RestClient::HeaderFields headers;
   headers["Authorization"] = "Bearer " + authToken;
+  if (!etag.empty()) {
+    headers["If-None-Match"] = etag;
+  }
   gcalApiConnection->SetHeaders(headers);
 
   RestClient::Response r = gcalApiConnection->get(path);
@@ -158,14 +322,39 @@ json GoogleCalendar::MakeGetRequest(string path) {
     gcalApiConnection->SetHeaders(headers);
     r = gcalApiConnection->get(path);
   }
+  return r;
+}
 
-  json resp;
+/**
+ *  GETs a page of an event list from the API, parsed straight into page. Returns false (with
+ *  the HTTP status in code) if the request failed. Pages are cached by path: asking again sends
+ *  their ETag, and if Google answers 304 Not Modified the cached page is copied out, without
+ *  downloading or parsing it again
+ */
+bool GoogleCalendar::GetEventPage(string path, EventPage &page, int *code) {
+  map<string, CachedEventPage>::iterator cached = eventPageCache.find(path);
+  RestClient::Response r = Get(path, cached != eventPageCache.end() ? cached->second.etag : string());
+  if (code != NULL) {
+    *code = r.code;
+  }
+  if (r.code == 304 && cached != eventPageCache.end()) {
+    cached->second.last_used = requestCount;
+    CopyEventPage(cached->second.page, page);
+    return true;
+  }
   if (r.code != 200) {
     cout << "Error executing request:" << endl;
     cout << "Error Code: " << r.code << endl;
     cout << r.body << endl;
-    return resp;
+    return false;
+  }
+  if (!ParseEventPage(r.body.data(), r.body.size(), page)) {
+    cout << "Could not parse the event list" << endl;
+    return false;
+  }
+  CachedEventPage *entry = CacheEntry(eventPageCache, path, r, requestCount);
+  if (entry != NULL) {
+    CopyEventPage(page, entry->page);
   }
-  resp = json::parse(r.body);
-  return resp;
+  return true;
 }
@@ -8,12 +8,28 @@
 #ifndef GCAL_H
 #define GCAL_H
 
+#include <time.h>
+#include <map>
 #include <string>
 #include "../lib/json.hpp"
 #include "restclient-cpp/connection.h"
+#include "event.h"
 using namespace std;
 using json = nlohmann::json;
 
+// Events asked for per page of an event list: a busy day fits in one
+#define EVENTS_PAGE_SIZE 100
+
+// How many event list pages GetEventPage keeps, by path, to revalidate with their ETag
+#define GET_CACHE_MAX_ENTRIES 16
+
+// An event list page as parsed, and the ETag it came with
+struct CachedEventPage {
+    string etag;
+    EventPage page;
+    unsigned long last_used;
+};
+
 class GoogleCalendar {
 public:
     GoogleCalendar();
@@ -23,8 +39,8 @@ public:
     void GetInstalledAppTokenForCode(string code);
     void RefreshAuthToken();
     void RequestInstalledAppToken();
-    json GetEventsBetween(string calendarID, string timeMin, string timeMax);
-    json MakeGetRequest(string path);
+    bool SyncEventsBetween(string calendarID, string timeMin, string timeMax, EventList &events);
+    bool GetEventPage(string path, EventPage &page, int *code);
 
 private:
     string clientID;
@@ -32,6 +48,21 @@ private:
     string authToken;
     string refreshToken;
     RestClient::Connection* gcalApiConnection;
+    map<string, CachedEventPage> eventPageCache;
+    unsigned long requestCount;
+
+    // Local copy of the events of one window, by event ID, kept up to date by SyncEventsBetween.
+    // Their strings are in syncStrings, which only grows until the next full list
+    string syncCalendarID;
+    string syncTimeMin;
+    string syncTimeMax;
+    string syncToken;
+    StringPool syncStrings;
+    map<string, Event> syncedEvents;
+
+    RestClient::Response Get(const string &path, const string &etag);
+    bool ListEvents(string path, StringPool &strings, map<string, Event> &events, int *code);
+    void SyncedEvents(EventList &events);
 };
 
 #endif
@@ -0,0 +1,203 @@
+/**
+ *  @filename   :   ghosting.cpp
+ *  @brief      :   Ghosting model that decides where the panel needs a cleanup refresh
+ */
+
+#include <string.h>
+#include <algorithm>    // std::max
+#include "ghosting.h"
+
+// Adds one to the 4-bit counter of every pixel set in mask, saturating at 15
+static uint32_t CountPixels(uint32_t counters, unsigned int mask) {
+  while (mask != 0) {
+    unsigned int shift = __builtin_ctz(mask) * 4;
+    if (((counters >> shift) & 0xF) != 0xF) {
+      counters += 1u << shift;
+    }
+    mask &= mask - 1;
+  }
+  return counters;
+}
+
+GhostingModel::GhostingModel() {
+  cells = NULL;
+  row_cells = 0;
+  height = 0;
+}
+
+size_t GhostingModel::BytesFor(unsigned int width, unsigned int height) {
+  return sizeof(WearCell) * width / 8 * height;
+}
+
+/**
+ *  @brief: uses cells (BytesFor(width, height) bytes, owned by the caller) as the wear map
+ */
+void GhostingModel::Attach(WearCell *cells, unsigned int width, unsigned int height) {
+  this->cells = cells;
+  this->row_cells = width / 8;
+  this->height = height;
+}
+
+// A run of identical cells in a saved wear map
+struct WearRun {
+    uint32_t count;
+    WearCell cell;
+};
+
+/**
+ *  @brief: writes the wear map to f as runs of identical cells. Most of the panel is whatever
+ *          the last full refresh left, so a map of hundreds of KB saves as a few KB
+ */
+bool GhostingModel::Save(FILE *f) const {
+  const size_t total = (size_t) row_cells * height;
+  size_t i = 0;
+  while (i < total) {
+    WearRun run;
+    run.cell = cells[i];
+    run.count = 1;
+    while (i + run.count < total && memcmp(&cells[i + run.count], &run.cell, sizeof run.cell) == 0) {
+      run.count++;
+    }
+    if (fwrite(&run, sizeof run, 1, f) != 1) {
+      return false;
+    }
+    i += run.count;
+  }
+  return true;
+}
+
+/**
+ *  @brief: reads a wear map written by Save, false if it is short or doesn't fit this panel
+ */
+bool GhostingModel::Load(FILE *f) {
+  const size_t total = (size_t) row_cells * height;
+  size_t i = 0;
+  while (i < total) {
+    WearRun run;
+    if (fread(&run, sizeof run, 1, f) != 1 || run.count == 0 || run.count > total - i) {
+      return false;
+    }
+    for (uint32_t c = 0; c < run.count; c++) {
+      cells[i++] = run.cell;
+    }
+  }
+  return true;
+}
+
+/**
+ *  @brief: records a partial refresh of rect going from old_frame to new_frame. Both frames
+ *          are in cairo A1 layout (bit set: black) with the given stride
+ */
+void GhostingModel::ChargePartial(const unsigned char *old_frame, const unsigned char *new_frame,
+                                  unsigned int stride, const DirtyRect &rect) {
+  for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+    for (unsigned int c = rect.x / 8; c < (rect.x + rect.width) / 8; c++) {
+      unsigned char before = old_frame[y * stride + c];
+      unsigned char after = new_frame[y * stride + c];
+      WearCell &cell = cells[y * row_cells + c];
+      cell.to_black = CountPixels(cell.to_black, after & ~before);
+      cell.to_white = CountPixels(cell.to_white, before & ~after);
+      if (cell.driven != UINT8_MAX) {
+        cell.driven++;
+      }
+    }
+  }
+}
+
+/**
+ *  @brief: records what a cleanup or colour window does outside rect: the gates of its rows are
+ *          on, so the cells beside it in those rows are driven by whatever the sources hold there,
+ *          as if by passes partial refreshes
+ */
+void GhostingModel::ChargeOutside(const DirtyRect &rect, unsigned int passes) {
+  for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+    WearCell *row = cells + y * row_cells;
+    for (unsigned int c = 0; c < row_cells; c++) {
+      if (c >= rect.x / 8 && c < (rect.x + rect.width) / 8) {
+        continue;
+      }
+      row[c].driven = row[c].driven + passes < UINT8_MAX ? row[c].driven + passes : UINT8_MAX;
+    }
+  }
+}
+
+/**
+ *  @brief: forgets the wear of the cells in rect, which just got a full waveform
+ */
+void GhostingModel::MarkClean(const DirtyRect &rect, time_t now) {
+  for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+    WearCell *row = cells + y * row_cells;
+    for (unsigned int c = rect.x / 8; c < (rect.x + rect.width) / 8; c++) {
+      memset(&row[c], 0, sizeof row[c]);
+      row[c].clean_hour = (uint16_t) (now / 3600);
+    }
+  }
+}
+
+void GhostingModel::MarkAllClean(time_t now) {
+  DirtyRect all = { 0, 0, row_cells * 8, height };
+  MarkClean(all, now);
+}
+
+/**
+ *  @brief: how much ghosting the cell has likely accumulated, see the GHOST_* weights
+ */
+unsigned int GhostingModel::Score(const WearCell &cell, time_t now) const {
+  if (cell.driven == 0) {
+    // Nothing but full waveforms since the last clean refresh
+    return 0;
+  }
+  unsigned int worstPixel = 0;
+  for (unsigned int shift = 0; shift < 32; shift += 4) {
+    unsigned int pixel = ((cell.to_black >> shift) & 0xF) * GHOST_WEIGHT_TO_BLACK +
+      ((cell.to_white >> shift) & 0xF) * GHOST_WEIGHT_TO_WHITE;
+    worstPixel = std::max(worstPixel, pixel);
+  }
+  // Ages past half the hour counter's range mean the clock went back
+  uint16_t hours = (uint16_t) (now / 3600) - cell.clean_hour;
+  if (hours >= 0x8000) {
+    hours = 0;
+  }
+  return worstPixel + cell.driven * GHOST_WEIGHT_DRIVEN + hours * GHOST_WEIGHT_PER_HOUR;
+}
+
+/**
+ *  @brief: whether any cell of rect is due a cleanup
+ */
+bool GhostingModel::IsHot(const DirtyRect &rect, time_t now) const {
+  for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+    const WearCell *row = cells + y * row_cells;
+    for (unsigned int c = rect.x / 8; c < (rect.x + rect.width) / 8; c++) {
+      if (Score(row[c], now) >= GHOST_THRESHOLD) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ *  @brief: collects the runs of hot cells in each row, joining runs separated by fewer than
+ *          gap_cells cool ones. Spans use the same columns as DiffFrames (one per cell), and
+ *          changed_pixels holds the number of hot cells in the span
+ */
+void GhostingModel::FindHotSpans(time_t now, unsigned int gap_cells, std::vector<DirtySpan> &spans) const {
+  spans.clear();
+  for (unsigned int y = 0; y < height; y++) {
+    const WearCell *row = cells + y * row_cells;
+    bool open = false;
+    for (unsigned int c = 0; c < row_cells; c++) {
+      if (Score(row[c], now) < GHOST_THRESHOLD) {
+        continue;
+      }
+      if (open && c <= spans.back().last + gap_cells) {
+        spans.back().last = c;
+        spans.back().changed_pixels++;
+      } else {
+        DirtySpan span = { (uint16_t) y, (uint16_t) c, (uint16_t) c, 1 };
+        spans.push_back(span);
+        open = true;
+      }
+    }
+  }
+}
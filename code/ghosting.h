@@ -0,0 +1,60 @@
+/**
+ *  @filename   :   ghosting.h
+ *  @brief      :   Header file for the ghosting model that decides where the panel needs a cleanup refresh
+ *  
+ */
+
+#ifndef GHOSTING_H
+#define GHOSTING_H
+
+// Score weights. A pixel's score counts the partial refreshes that flipped it since its cell
+// was last cleanly refreshed; the cell adds the passes that drove it and, once it has any
+// partial history, the hours since it was clean. A cell at GHOST_THRESHOLD is "hot"
+#define GHOST_WEIGHT_TO_BLACK 3
+#define GHOST_WEIGHT_TO_WHITE 3
+#define GHOST_WEIGHT_DRIVEN 1
+#define GHOST_WEIGHT_PER_HOUR 1
+#define GHOST_THRESHOLD 30
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "frameops.h"
+
+// Wear of one 8x1 cell (one frame byte) since its last clean refresh. Transition counts are kept
+// per pixel, as 4-bit saturating counters: pixel i of the byte (bit i) uses bits 4i..4i+3
+struct WearCell {
+    uint32_t to_black;      // partial refreshes that turned the pixel black
+    uint32_t to_white;      // partial refreshes that turned the pixel white
+    uint8_t driven;         // partial refreshes whose window covered the cell, changed or not
+    uint8_t reserved;
+    uint16_t clean_hour;    // when the cell last got a full waveform (hours since the epoch, mod 2^16)
+};
+
+class GhostingModel {
+public:
+    GhostingModel();
+
+    static size_t BytesFor(unsigned int width, unsigned int height);
+    void Attach(WearCell *cells, unsigned int width, unsigned int height);
+    bool Save(FILE *f) const;
+    bool Load(FILE *f);
+
+    void ChargePartial(const unsigned char *old_frame, const unsigned char *new_frame,
+                       unsigned int stride, const DirtyRect &rect);
+    void ChargeOutside(const DirtyRect &rect, unsigned int passes);
+    void MarkClean(const DirtyRect &rect, time_t now);
+    void MarkAllClean(time_t now);
+    unsigned int Score(const WearCell &cell, time_t now) const;
+    bool IsHot(const DirtyRect &rect, time_t now) const;
+    void FindHotSpans(time_t now, unsigned int gap_cells, std::vector<DirtySpan> &spans) const;
+
+private:
+    WearCell *cells;
+    unsigned int row_cells;
+    unsigned int height;
+};
+
+#endif
@@ -31,97 +31,79 @@
 #include <string>
 #include <math.h>
 #include <ctime>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <algorithm>
 #include <pango/pangocairo.h>
 #include "screen.h"
 #include "gcal.h"
+#include "fetcher.h"
 #include "secrets.h"
-#include "../lib/json.hpp"
-
-using json = nlohmann::json;
 
 const char *GOOGLE_TIME_FORMAT = "%Y-%m-%dT%H:%M:%S%z";
-const char *GOOGLE_DATE_FORMAT = "%Y-%m-%d";
 const char *HEADPHONES_PNG = "/home/pi/upNext/code/headphones.png";
 const char *PARTY_PNG = "/home/pi/upNext/code/party.png";
+const char *SCREEN_STATE_PATH = "/home/pi/upNext/screen.state";
+const char *WAVEFORMS_PATH = "/home/pi/upNext/waveforms.txt";
 
 const char *TITLE_FONT = "Proxima Nova Regular 40";
 const char *SUBTITLE_FONT = "Proxima Nova Regular 24";
 const char *SMALL_TEXT_BOLD_FONT = "Proxima Nova Bold 16";
 const char *SMALL_TEXT_REGULAR_FONT = "Proxima Nova Regular 16";
 
-long int datediff(struct tm * a, struct tm * b);
-void convert_event_time_to_time(json eventTime, tm* time);
-int get_event_status_code(json event);
-bool is_more_important_event(json eventA, json eventB);
-json get_events(GoogleCalendar* gcal);
+// How often events are fetched (in the background); the screen is only redrawn when they or
+// the time call for it
+const int FETCH_INTERVAL_S = 10;
+
+#ifndef TFD_TIMER_CANCEL_ON_SET
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+bool same_event(const Event *eventA, const Event *eventB);
+bool is_more_important_event(const Event *eventA, const Event *eventB);
+bool get_events(GoogleCalendar* gcal, EventList &events);
 
 void draw_clock(cairo_t *cr);
-void draw_events(cairo_t *cr, json events);
+void draw_events(cairo_t *cr, cairo_t *red_cr, const EventList &events);
 void draw_message_with_headphones(cairo_t *cr, string message);
 void draw_no_more_meetings(cairo_t *cr);
 
 void draw_time_tagline(cairo_t *cr, string c_str);
-string time_remaining_tagline(tm* endTime);
+string time_remaining_tagline(time_t endTime);
 string time_till_tagline(int delta_min);
 
 void draw_while_until_next_event(cairo_t *cr, int delta_min);
-void draw_secondary_event_line(cairo_t *cr, json event);
-void draw_main_event(cairo_t *cr, json event);
-
-void print_event(json event);
-
-/* Returns time in seconds between two datetimes. Long can handle +/-60 years
-* Does not use mktime, because of issues with daylight savings
-* See https://stackoverflow.com/questions/12122084/confusing-behaviour-of-mktime-function-increasing-tm-hour-count-by-one
-*/
-long int datediff(struct tm * from, struct tm * to) {
-  return to->tm_sec - from->tm_sec + 
-    60l * (to->tm_min - from->tm_min +
-        60l * (to->tm_hour - from->tm_hour +
-          24l * (to->tm_yday - from->tm_yday + 
-            365l * (to->tm_year - from->tm_year)
-          )
-        )
-      );
-}
-
-void convert_event_time_to_time(json eventTime, tm* time) {
-  if (eventTime["dateTime"].is_null()) {
-    // All day events
-    strptime(eventTime["date"].get<string>().c_str(), GOOGLE_DATE_FORMAT, time);
-  } else {
-    strptime(eventTime["dateTime"].get<string>().c_str(), GOOGLE_TIME_FORMAT, time);
+void draw_secondary_event_line(cairo_t *cr, const Event *event);
+void draw_main_event(cairo_t *cr, cairo_t *title_cr, const Event &event);
+
+void print_event(const Event *event);
+void clear_region(cairo_t *cr, const DirtyRect &region);
+time_t next_frame_change(const EventList &events, time_t now);
+bool sleep_until(int timer_fd, int wakeup_fd, int stop_fd, time_t wake_at);
+bool stop_requested(int stop_fd);
+
+// Events are the same one if they have the same id; two missing events are the same too
+bool same_event(const Event *eventA, const Event *eventB) {
+  if (eventA == NULL || eventB == NULL) {
+    return eventA == eventB;
   }
+  return strcmp(eventA->id, eventB->id) == 0;
 }
 
-int get_event_status_code(json event) {
-  // 0 == "accepted"
-  // 1 == own event, no status
-  // 2 == "tentative"
-  // 3 == "needsAction"
-  // 4 == "declined"
-  if (event["attendees"].is_null()){
-    return 1;
-  }
-  string status = event["attendees"][0]["responseStatus"];
-  if (status == "accepted") {
-    return 0;
-  } else if (status == "tentative") {
-    return 2;
-  } else if (status == "needsAction") {
-    return 3;
-  } else if (status == "declined") {
-    return 4;
-  } 
-  return 99;
-}
-
-json get_events(GoogleCalendar* gcal) {
+// Runs on the fetcher's thread: localtime_r, as the render loop uses localtime
+bool get_events(GoogleCalendar* gcal, EventList &events) {
     char buffer [80];
 
     time_t t = time(0);   // get time now
-    struct tm * today = localtime( & t );
+    struct tm today_tm;
+    struct tm * today = localtime_r( & t, &today_tm );
     today->tm_hour = 0;
     today->tm_min = 0;
     today->tm_sec = 0;
@@ -130,7 +112,8 @@ json get_events(GoogleCalendar* gcal) {
     string today_str(buffer);
 
     // We go until tomorrow morning to pick up tomorrow's all day events
-    struct tm * tomorrow = localtime( & t );
+    struct tm tomorrow_tm;
+    struct tm * tomorrow = localtime_r( & t, &tomorrow_tm );
     tomorrow->tm_hour = 0;
     tomorrow->tm_min = 0;
     tomorrow->tm_sec = 1;
@@ -139,26 +122,31 @@ json get_events(GoogleCalendar* gcal) {
     strftime(buffer, 80, GOOGLE_TIME_FORMAT, tomorrow);
     string tomorrow_str(buffer);
 
-    json events = gcal->GetEventsBetween("primary", today_str, tomorrow_str);
-    //cout << events.dump(4) << endl;
-    return events;
+    // Only what changed since the last call is fetched; a new day starts over
+    return gcal->SyncEventsBetween("primary", today_str, tomorrow_str, events);
 }
 
-void print_event(json event) {
-    if (event.is_null()) {
+void print_event(const Event *event) {
+    if (event == NULL) {
       cout << "Null" << endl;
       return;
     }
 
-    cout << "Event: " << event["summary"] << " | " << event["status"] << " | ";
-    if (event["start"]["dateTime"].is_null()) {
-      cout << "All day: " << event["start"]["date"] << endl;
+    char buffer [80];
+    time_t start = event->start;
+    struct tm start_tm;
+    localtime_r( &start, &start_tm );
+    cout << "Event: " << event->summary << " | " << (int) event->status << " | ";
+    if (event->flags & EVENT_ALL_DAY) {
+      strftime(buffer, 80, "%Y-%m-%d", &start_tm);
+      cout << "All day: " << buffer << endl;
     } else {
-      cout << event["start"]["dateTime"] << endl;
+      strftime(buffer, 80, GOOGLE_TIME_FORMAT, &start_tm);
+      cout << buffer << endl;
     }
 }
 
-bool is_more_important_event(json eventA, json eventB) {
+bool is_more_important_event(const Event *eventA, const Event *eventB) {
   // Returns true if eventA is "better" than eventB. In a tie, returns false.
   //
   // We prioritize accepted events of other people over own events,
@@ -177,51 +165,39 @@ bool is_more_important_event(json eventA, json eventB) {
   // Finally, we prioritize non-recurring events over recurring events.
 
   // Something is always better than nothing! We check A first, because tie returns false
-  if (eventA.is_null()) {
+  if (eventA == NULL) {
     return false;
   }
-  if (eventB.is_null()) {
+  if (eventB == NULL) {
     return true;
   }
 
-  // Checking response status - lower is better
-  int eventAStatus = get_event_status_code(eventA);
-  int eventBStatus = get_event_status_code(eventB);
-  if (eventAStatus < eventBStatus) {
+  // Checking response status (see EventStatus) - lower is better
+  if (eventA->status < eventB->status) {
     return true;
-  } else if (eventAStatus > eventBStatus) {
+  } else if (eventA->status > eventB->status) {
     return false;
   }
 
-  struct tm eventAStart = {};
-  struct tm eventAEnd = {};
-  struct tm eventBStart = {};
-  struct tm eventBEnd = {};
-  convert_event_time_to_time(eventA["start"], &eventAStart);
-  convert_event_time_to_time(eventA["end"], &eventAEnd);
-  convert_event_time_to_time(eventB["start"], &eventBStart);
-  convert_event_time_to_time(eventB["end"], &eventBEnd);
-
-  // dateDiff(X,Y) is Y - X
-  long int deltaStart = datediff(&eventAStart, &eventBStart);
-  if (deltaStart < 0) {
-    // Y - X < 0 , so X > Y, so A started later, and is better
+  if (eventA->start > eventB->start) {
+    // A started later, and is better
     return true;
-  } else if (deltaStart > 0) {
+  } else if (eventA->start < eventB->start) {
     return false;
   }
 
-  long int deltaEnd = datediff(&eventAEnd, &eventBEnd);
-  if (deltaEnd < 0) {
-    // Y - X < 0 , so X > Y, so A ends later, and is worse
+  if (eventA->end > eventB->end) {
+    // A ends later, and is worse
     return false;
-  } else if (deltaEnd > 0) {
+  } else if (eventA->end < eventB->end) {
     return true;
   }
 
-  if (eventA["recurringEventId"].is_null() && !eventB["recurringEventId"].is_null()) {
+  bool eventARecurring = (eventA->flags & EVENT_RECURRING) != 0;
+  bool eventBRecurring = (eventB->flags & EVENT_RECURRING) != 0;
+  if (!eventARecurring && eventBRecurring) {
     return true;
-  } else if (!eventA["recurringEventId"].is_null() && eventB["recurringEventId"].is_null()) {
+  } else if (eventARecurring && !eventBRecurring) {
     return false;
   }
 
@@ -229,34 +205,25 @@ bool is_more_important_event(json eventA, json eventB) {
   return false;
 }
 
-void draw_events(cairo_t *cr, json events) {
-  int num_events = events.size();
-  json best_current_event;
-  json second_current_event;
-  json best_next_event;
-  json second_next_event;
-  json today_all_day_event;
-  json tomorrow_all_day_event;
-  json first_event_of_day;
-
-  time_t currentTime = time(0);
-  struct tm * now = localtime( &currentTime );
-  struct tm event_start_time = {};
-  struct tm event_end_time = {};
-  struct tm best_next_start_time = {};
-  struct tm second_next_start_time = {};
+void draw_events(cairo_t *cr, cairo_t *red_cr, const EventList &events) {
+  // Picked out of events, which outlives the drawing: nothing is copied
+  const Event *best_current_event = NULL;
+  const Event *second_current_event = NULL;
+  const Event *best_next_event = NULL;
+  const Event *second_next_event = NULL;
+  const Event *today_all_day_event = NULL;
+  const Event *tomorrow_all_day_event = NULL;
+  const Event *first_event_of_day = NULL;
+
+  time_t now = time(0);
 
   cout << "Processing events: " << endl;
-  json event;
-  for (int i = 0; i < num_events; i++) {
-    event = events[i];
+  for (size_t i = 0; i < events.events.size(); i++) {
+    const Event *event = &events.events[i];
     print_event(event);
-    convert_event_time_to_time(event["start"], &event_start_time);
-    convert_event_time_to_time(event["end"], &event_end_time);
 
-    if (event["start"]["dateTime"].is_null()) {
-      // All day event
-      if (datediff(now, &event_start_time) < 0) {
+    if (event->flags & EVENT_ALL_DAY) {
+      if (event->start < now) {
         today_all_day_event = event;
       } else {
         tomorrow_all_day_event = event;
@@ -264,16 +231,16 @@ void draw_events(cairo_t *cr, json events) {
       continue;
     }
 
-    if (first_event_of_day.is_null()) {
+    if (first_event_of_day == NULL) {
       // First real event!
       first_event_of_day = event;
     }
 
-    if (datediff(now, &event_end_time) < 0) {
+    if (event->end < now) {
       continue;
     }
 
-    if (datediff(now, &event_start_time) < 0) {
+    if (event->start < now) {
       // Pick the best two current events
       if (is_more_important_event(event, best_current_event)) {
         // By definition, we know best_current_event is always better than second_current_event
@@ -286,23 +253,17 @@ void draw_events(cairo_t *cr, json events) {
       // For upcoming events, only 4 reasons why we'd care about this event:
       // we don't have a first or a second, or this starts at the same time
       // as one of those and is more important
-      if (best_next_event.is_null()) {
+      if (best_next_event == NULL) {
         best_next_event = event;
-        best_next_start_time = event_start_time;
-      } else if (datediff(&best_next_start_time, &event_start_time) == 0 &&
+      } else if (best_next_event->start == event->start &&
           is_more_important_event(event, best_next_event)) {
         second_next_event = best_next_event;
-        second_next_start_time = best_next_start_time;
-
         best_next_event = event;
-        best_next_start_time = event_start_time;
-      } else if (second_next_event.is_null()) {
+      } else if (second_next_event == NULL) {
         second_next_event = event;
-        second_next_start_time = event_start_time;
-      } else if (datediff(&second_next_start_time, &event_start_time) == 0 &&
+      } else if (second_next_event->start == event->start &&
           is_more_important_event(event, second_next_event)) {
         second_next_event = event;
-        second_next_start_time = event_start_time;
       }
     }
   }
@@ -317,9 +278,8 @@ void draw_events(cairo_t *cr, json events) {
   print_event(second_next_event);
 
   int delta_min = 0;
-  if (!best_next_event.is_null()) {
-    convert_event_time_to_time(best_next_event["start"], &event_start_time);
-    long int delta_seconds = datediff(now, &event_start_time);
+  if (best_next_event != NULL) {
+    long int delta_seconds = best_next_event->start - now;
     delta_min = (int) round(delta_seconds / 60.0);
     cout << "Time until next event: " << delta_min << " minutes" << endl;
   }
@@ -368,10 +328,10 @@ void draw_events(cairo_t *cr, json events) {
   //   details (i.e. *not* the "following" event)
   // * If we're at the last event(s) of the day and so don't anything to put in the secondary event slot, see
   //   if we have an all day event tomorrow. If we do, show that, otherwise leave it blank
-  json primary_event;
-  json secondary_event;
-  bool in_meeting = !best_current_event.is_null();
-  bool have_next_event = !best_next_event.is_null();
+  const Event *primary_event = NULL;
+  const Event *secondary_event = NULL;
+  bool in_meeting = best_current_event != NULL;
+  bool have_next_event = best_next_event != NULL;
   cout << "In meeting: " << in_meeting << endl;
   cout << "Have next: " << have_next_event << endl;
 
@@ -383,21 +343,21 @@ void draw_events(cairo_t *cr, json events) {
     }
   } else if (have_next_event && delta_min <= 30) {
     primary_event = best_next_event;
-  } else if (!today_all_day_event.is_null() && best_next_event == first_event_of_day) {
+  } else if (today_all_day_event != NULL && same_event(best_next_event, first_event_of_day)) {
     primary_event = today_all_day_event;
   } else {
     // making this explicit that we _don't_ want a primary event in this case
   }
 
-  if (primary_event == best_next_event) {
+  if (same_event(primary_event, best_next_event)) {
     secondary_event = second_next_event;
-  } else if (!second_current_event.is_null()) {
+  } else if (second_current_event != NULL) {
     secondary_event = second_current_event;
   } else {
     secondary_event = best_next_event;
   }
 
-  if (secondary_event.is_null() && !tomorrow_all_day_event.is_null()) {
+  if (secondary_event == NULL && tomorrow_all_day_event != NULL) {
     secondary_event = tomorrow_all_day_event;
   }
 
@@ -407,7 +367,7 @@ void draw_events(cairo_t *cr, json events) {
   print_event(secondary_event);
 
   // Now, we draw it
-  if (primary_event.is_null()) {
+  if (primary_event == NULL) {
     if (have_next_event) {
       draw_while_until_next_event(cr, delta_min);
     } else {
@@ -415,23 +375,27 @@ void draw_events(cairo_t *cr, json events) {
     }
     draw_secondary_event_line(cr, secondary_event);
   } else {
-    draw_main_event(cr, primary_event);
+    // Highlight the meeting that's on right now in red. It stays up for the whole meeting, and
+    // while it does the screen only gets a slow colour refresh where red changes or sits next to
+    // what changes, or when most of the screen changes: ghosting cleanups wait for it to go
+    bool current = same_event(primary_event, best_current_event);
+    draw_main_event(cr, current ? red_cr : cr, *primary_event);
     draw_secondary_event_line(cr, secondary_event);
 
     // Drawing tagline
     string tagline;
-    if (primary_event == best_current_event) {
-      convert_event_time_to_time(primary_event["end"], &event_end_time);
-      tagline = time_remaining_tagline(&event_end_time);
-    } else if (primary_event == best_next_event) {
+    if (current) {
+      tagline = time_remaining_tagline(primary_event->end);
+    } else if (same_event(primary_event, best_next_event)) {
       tagline = time_till_tagline(delta_min);
-    } else if (primary_event == today_all_day_event) {
+    } else if (same_event(primary_event, today_all_day_event)) {
       tagline = "All day:";
     }
     draw_time_tagline(cr, tagline);
   }
 }
 
+// Stays inside CLOCK_REGION (screen.h), which is refreshed on its own
 void draw_clock(cairo_t *cr) {
   cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
 
@@ -518,9 +482,11 @@ void draw_time_tagline(cairo_t *cr, string tagline) {
   g_object_unref (layout);
 }
 
-string time_remaining_tagline(tm* endTime) {
+string time_remaining_tagline(time_t endTime) {
   static char timestr[20];
-  strftime(timestr, 20 * sizeof(char), "Until %-I:%M%P:", endTime);
+  struct tm end_tm;
+  localtime_r( &endTime, &end_tm );
+  strftime(timestr, 20 * sizeof(char), "Until %-I:%M%P:", &end_tm);
   return string(timestr);
 }
 
@@ -555,7 +521,7 @@ void draw_while_until_next_event(cairo_t *cr, int delta_min) {
   draw_message_with_image(cr, os.str(), HEADPHONES_PNG);
 }
 
-void draw_main_event(cairo_t *cr, json event) {
+void draw_main_event(cairo_t *cr, cairo_t *title_cr, const Event &event) {
   int margin = 10;
   int startY = 50;
   int title_width;
@@ -567,11 +533,10 @@ void draw_main_event(cairo_t *cr, json event) {
   PangoFontDescription *title_font = pango_font_description_from_string (TITLE_FONT);
   pango_layout_set_font_description (layout, title_font);
 
-  string summary = event["summary"];
-  pango_layout_set_text (layout, summary.c_str(), -1);
+  pango_layout_set_text (layout, event.summary, -1);
   // 2 lines, ellipsize after that
   pango_layout_set_width (layout, (400 - 2 * margin) * PANGO_SCALE);
-  int max_lines = event["location"].is_null() ? 3 : 2;
+  int max_lines = event.location == NULL ? 3 : 2;
   // Handy, but strange: if height is negative, it will be the (negative of) maximum number of lines per paragraph.
   pango_layout_set_height (layout, -max_lines);
   pango_layout_set_wrap (layout, PANGO_WRAP_WORD_CHAR);
@@ -579,15 +544,14 @@ void draw_main_event(cairo_t *cr, json event) {
 
   pango_layout_get_pixel_size(layout, &title_width, &title_height);
 
-  cairo_move_to (cr, margin, startY);
-  pango_cairo_show_layout(cr, layout);
+  cairo_move_to (title_cr, margin, startY);
+  pango_cairo_show_layout(title_cr, layout);
 
-  if (!event["location"].is_null()) {
+  if (event.location != NULL) {
     PangoFontDescription *subtitle_font = pango_font_description_from_string (SUBTITLE_FONT);
     pango_layout_set_font_description (layout, subtitle_font);
 
-    string location = event["location"];
-    pango_layout_set_text (layout, location.c_str(), -1);
+    pango_layout_set_text (layout, event.location, -1);
     pango_layout_set_width (layout, (400 - 2 * margin) * PANGO_SCALE);
     pango_layout_set_height (layout, -1);
     pango_layout_set_ellipsize (layout, PANGO_ELLIPSIZE_END);
@@ -604,28 +568,29 @@ void draw_main_event(cairo_t *cr, json event) {
 
 
 
-void draw_secondary_event_line(cairo_t *cr, json event) {
-  if (event.is_null()) {
+void draw_secondary_event_line(cairo_t *cr, const Event *event) {
+  if (event == NULL) {
     return;
   }
 
   string time_str;
-  if (event["start"]["dateTime"].is_null()) {
+  if (event->flags & EVENT_ALL_DAY) {
     // All day event -- in current logic, this is always tomorrow
     time_str = "Tomorrow:";
   } else {
     ostringstream os;
-    struct tm startTime = {};
-    convert_event_time_to_time(event["start"], &startTime);
+    time_t start = event->start;
+    time_t end = event->end;
+    struct tm startTime;
+    localtime_r( &start, &startTime );
 
     static char timestr[10];
     time_t currentTime = time(0);
-    struct tm * now = localtime( &currentTime );
 
-    if (datediff(now, &startTime) < 0) {
+    if (start < currentTime) {
       // Another concurrent event
-      struct tm endTime = {};
-      convert_event_time_to_time(event["end"], &endTime);
+      struct tm endTime;
+      localtime_r( &end, &endTime );
       strftime(timestr, 10 * sizeof(char), "%-I:%M%P", &endTime);
       os << "Also - until " << timestr << ":";
       time_str = os.str();
@@ -653,8 +618,7 @@ void draw_secondary_event_line(cairo_t *cr, json event) {
   PangoFontDescription *regular_font = pango_font_description_from_string (SMALL_TEXT_REGULAR_FONT);
   pango_layout_set_font_description (layout, regular_font);
 
-  string summary = event["summary"];
-  pango_layout_set_text (layout, summary.c_str(), -1);
+  pango_layout_set_text (layout, event->summary, -1);
   pango_layout_set_width (layout, (400 - text_width - 25) * PANGO_SCALE);
   pango_layout_set_ellipsize (layout, PANGO_ELLIPSIZE_END);
   cairo_move_to (cr, text_width + 15, 300 - text_height - 10);
@@ -665,6 +629,107 @@ void draw_secondary_event_line(cairo_t *cr, json event) {
   g_object_unref (layout);
 }
 
+void clear_region(cairo_t *cr, const DirtyRect &region) {
+  cairo_save (cr);
+  cairo_rectangle (cr, region.x, region.y, region.width, region.height);
+  cairo_clip (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+  cairo_paint (cr);
+  cairo_restore (cr);
+}
+
+/* Returns the first time after now at which draw_events could draw something different for
+ * these events: one of them starting or ending, the minutes until the next one ticking down
+ * (which is also when the 5 and 30 minute thresholds are crossed), or midnight.
+ * The clock is not included
+ */
+time_t next_frame_change(const EventList &events, time_t now) {
+  struct tm local;
+  localtime_r(&now, &local);
+
+  // Midnight: all day events move from tomorrow to today
+  struct tm midnight = local;
+  midnight.tm_mday += 1;
+  midnight.tm_hour = 0;
+  midnight.tm_min = 0;
+  midnight.tm_sec = 0;
+  midnight.tm_isdst = -1;
+  time_t change = mktime(&midnight);
+
+  time_t next_start = 0;
+  for (size_t i = 0; i < events.events.size(); i++) {
+    const Event &event = events.events[i];
+    if (event.flags & EVENT_ALL_DAY) {
+      continue;
+    }
+    time_t start_at = event.start;
+    time_t end_at = event.end;
+
+    // draw_events compares strictly: an event is current, or over, the second after
+    if (start_at + 1 > now) {
+      change = std::min(change, start_at + 1);
+    }
+    if (end_at + 1 > now) {
+      change = std::min(change, end_at + 1);
+    }
+    if (start_at >= now && (next_start == 0 || start_at < next_start)) {
+      next_start = start_at;
+    }
+  }
+
+  if (next_start != 0) {
+    // The minutes until the next event are rounded, so they go down 31 seconds into a minute
+    long delta_min = lround((next_start - now) / 60.0);
+    time_t tick = next_start - (60 * delta_min - 31);
+    if (tick > now) {
+      change = std::min(change, tick);
+    }
+  }
+  return change;
+}
+
+/* Sleeps on timer_fd until the wall clock reads wake_at, or until wakeup_fd or stop_fd is readable.
+ * The deadline is absolute, so however long rendering took, wakeups stay on the second they
+ * were meant for. Returns false if the clock was set meanwhile, which ends the sleep early:
+ * deadlines need working out again
+ */
+bool sleep_until(int timer_fd, int wakeup_fd, int stop_fd, time_t wake_at) {
+  struct itimerspec deadline;
+  memset(&deadline, 0, sizeof deadline);
+  deadline.it_value.tv_sec = wake_at;
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &deadline, NULL) != 0) {
+    printf("Setting the wakeup timer failed: %s\n", strerror(errno));
+    sleep(1);
+    return true;
+  }
+  struct pollfd fds[3] = { { timer_fd, POLLIN, 0 }, { wakeup_fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+  if (poll(fds, 3, -1) < 0) {
+    if (errno != EINTR) {
+      printf("Waiting for the wakeup timer failed: %s\n", strerror(errno));
+      sleep(1);
+    }
+    return true;
+  }
+  uint64_t expirations;
+  if ((fds[0].revents & POLLIN) && read(timer_fd, &expirations, sizeof expirations) < 0) {
+    if (errno == ECANCELED) {
+      return false;
+    }
+    if (errno != EINTR) {
+      printf("Waiting for the wakeup timer failed: %s\n", strerror(errno));
+      sleep(1);
+    }
+  }
+  return true;
+}
+
+/* Whether SIGTERM or SIGINT (e.g. systemctl stop) arrived on stop_fd, a signalfd
+ */
+bool stop_requested(int stop_fd) {
+  struct pollfd fd = { stop_fd, POLLIN, 0 };
+  return poll(&fd, 1, 0) > 0;
+}
+
 int main(void)
 {
     Screen screen;
@@ -673,8 +738,30 @@ int main(void)
         return -1;
     }
 
-    //screen.Clear();
-    screen.HardWipe();
+    // Optional: how frames are refreshed, and a recording of them to replay (see replay.cpp)
+    RefreshPolicy *policy = NULL;
+    if (getenv("UPNEXT_REFRESH_POLICY") != NULL) {
+      policy = CreateRefreshPolicy(getenv("UPNEXT_REFRESH_POLICY"));
+      if (policy == NULL) {
+        printf("Unknown refresh policy %s, using the default\n", getenv("UPNEXT_REFRESH_POLICY"));
+      }
+    }
+    screen.SetRefreshPolicy(policy);
+    if (getenv("UPNEXT_RECORD_FRAMES") != NULL) {
+      screen.SetRecordFile(getenv("UPNEXT_RECORD_FRAMES"));
+    }
+
+    screen.SetClockRegion(CLOCK_REGION);
+
+    // Waveforms tuned by panel temperature, the built-in ones if there are none
+    screen.LoadWaveformFile(WAVEFORMS_PATH);
+
+    // Only wipe if we don't know what's on the screen (or it's due one anyway)
+    screen.SetStateFile(SCREEN_STATE_PATH);
+    if (!screen.RestoreState()) {
+      //screen.Clear();
+      screen.HardWipe();
+    }
 
     GoogleCalendar* gcal = new GoogleCalendar();
     gcal->SetCredentials(GCAL_CLIENT_ID, GCAL_CLIENT_SECRET);
@@ -684,25 +771,84 @@ int main(void)
 
     cairo_surface_t *surface = screen.GetCairoSurface();
     cairo_t *cr = cairo_create (surface);
+    cairo_t *red_cr = cairo_create (screen.GetRedCairoSurface());
 
-    // Every 10 seconds, fetch events and re-render
-    while(true) {
-      json events = get_events(gcal);
+    int timer_fd = timerfd_create(CLOCK_REALTIME, 0);
+    if (timer_fd < 0) {
+        printf("Wakeup timer creation failed\n");
+        return -1;
+    }
 
-      draw_clock(cr);
-      draw_events(cr, events);
+    // Stop signals are taken from a signalfd, so the loop below ends and the screen state gets
+    // saved on the way out. Blocked before the fetcher starts, so its thread never takes them
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    int stop_fd = signalfd(-1, &stop_signals, 0);
+    if (stop_fd < 0) {
+        printf("Stop signal setup failed\n");
+        return -1;
+    }
 
-      screen.Render();
+    // Events are fetched every 10 seconds, off this thread: a slow network never holds up
+    // the screen. It is only redrawn when the events change, or at the next moment the time
+    // makes it look different; in between, the clock on the minute
+    EventFetcher fetcher;
+    if (!fetcher.Start(gcal, get_events, FETCH_INTERVAL_S)) {
+        printf("Event fetcher failed to start\n");
+        return -1;
+    }
 
-      // clear cairo context
-      cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
-      cairo_paint (cr);
-      cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+    const EventSnapshot *snapshot = NULL;
+    time_t redraw_at = 0;
+    time_t clock_at = 0;
+    while(!stop_requested(stop_fd)) {
+      time_t now = time(0);
+      const EventSnapshot *latest = fetcher.TakeLatest();
+      if (latest != NULL) {
+        delete snapshot;
+        snapshot = latest;
+        redraw_at = now;
+      }
 
-      sleep(10);
+      if (snapshot != NULL && now >= redraw_at) {
+        // clear cairo context
+        cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+        cairo_paint (cr);
+        cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+        cairo_set_operator (red_cr, CAIRO_OPERATOR_CLEAR);
+        cairo_paint (red_cr);
+        cairo_set_operator (red_cr, CAIRO_OPERATOR_OVER);
+
+        draw_clock(cr);
+        draw_events(cr, red_cr, snapshot->events);
+
+        screen.Render(now);
+        redraw_at = next_frame_change(snapshot->events, now);
+      } else if (now >= clock_at) {
+        // Only the clock: nothing else is redrawn, or refreshed along with it
+        clear_region(cr, CLOCK_REGION);
+        draw_clock(cr);
+        screen.RenderRegion(CLOCK_REGION, now);
+      }
+      clock_at = now - now % 60 + 60;
+
+      time_t wake_at = snapshot != NULL ? std::min(clock_at, redraw_at) : clock_at;
+      if (!sleep_until(timer_fd, fetcher.WakeupFd(), stop_fd, wake_at)) {
+        cout << "Clock was set, redrawing" << endl;
+        redraw_at = 0;
+      }
     }
 
+    fetcher.Stop();
+    delete snapshot;
+    close(stop_fd);
+    close(timer_fd);
+    cairo_destroy (red_cr);
     cairo_destroy (cr);
     screen.Cleanup();
+    delete policy;
     return 0;
 }
@@ -0,0 +1,127 @@
+/**
+ *  @filename   :   reference.cpp
+ *  @brief      :   Straightforward versions of the optimized kernels and parsers, see reference.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "reference.h"
+
+/**
+ *  @brief: DiffFrames one byte at a time, the way Screen used to find dirty bytes
+ */
+unsigned int DiffFramesBytewise(const unsigned char *old_frame, const unsigned char *new_frame,
+                                unsigned int row_bytes, unsigned int stride, unsigned int height,
+                                unsigned int gap_bytes, std::vector<DirtySpan> &spans) {
+  unsigned int total_changed = 0;
+  spans.clear();
+  for (unsigned int row = 0; row < height; row++) {
+    const unsigned char *a = old_frame + row * stride;
+    const unsigned char *b = new_frame + row * stride;
+    bool open = false;
+    DirtySpan span = { (uint16_t) row, 0, 0, 0 };
+    for (unsigned int col = 0; col < row_bytes; col++) {
+      if (a[col] == b[col]) {
+        continue;
+      }
+      unsigned int changed = 0;
+      for (int bit = 0; bit < 8; bit++) {
+        changed += ((a[col] ^ b[col]) >> bit) & 1;
+      }
+      total_changed += changed;
+      if (open && col - span.last - 1 > gap_bytes) {
+        spans.push_back(span);
+        open = false;
+      }
+      if (!open) {
+        span.first = col;
+        span.changed_pixels = 0;
+        open = true;
+      }
+      span.last = col;
+      span.changed_pixels += changed;
+    }
+    if (open) {
+      spans.push_back(span);
+    }
+  }
+  return total_changed;
+}
+
+/**
+ *  @brief: ConvertCairoA1ToPanel one pixel at a time, straight from the formats' definitions.
+ *          Cairo A1: 32-bit words in native byte order, pixel x at bit x % 32 counting from the
+ *          least significant bit on little-endian machines and from the most significant one on
+ *          big-endian machines, 1 for ink. Panel: pixel x at bit 7 - x % 8 of byte x / 8, 0 for ink
+ */
+void ConvertCairoA1ToPanelBitwise(const unsigned char *cairo_data, unsigned char *panel_data, unsigned int bytes) {
+  std::vector<unsigned char> in(cairo_data, cairo_data + bytes);
+  in.resize((bytes + 3) / 4 * 4);
+  for (unsigned int x = 0; x < bytes * 8; x++) {
+    uint32_t word;
+    memcpy(&word, &in[x / 32 * 4], sizeof word);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    bool ink = (word >> (31 - x % 32)) & 1;
+#else
+    bool ink = (word >> (x % 32)) & 1;
+#endif
+    unsigned char bit = 0x80 >> (x % 8);
+    if (ink) {
+      panel_data[x / 8] &= ~bit;
+    } else {
+      panel_data[x / 8] |= bit;
+    }
+  }
+}
+
+/**
+ *  @brief: ParseEventTime with strptime, as it was first written: %z for times, and mktime
+ *          for the local midnight of dates
+ */
+bool ParseEventTimeStrptime(const char *value, size_t length, bool date, int64_t *time) {
+  char buffer[40];
+  if (length >= sizeof buffer) {
+    return false;
+  }
+  memcpy(buffer, value, length);
+  buffer[length] = '\0';
+  struct tm parsed = {};
+  if (!date) {
+    if (strptime(buffer, "%Y-%m-%dT%H:%M:%S%z", &parsed) == NULL) {
+      return false;
+    }
+    long offset = parsed.tm_gmtoff;
+    *time = (int64_t) timegm(&parsed) - offset;
+    return true;
+  }
+  if (strptime(buffer, "%Y-%m-%d", &parsed) == NULL) {
+    return false;
+  }
+  parsed.tm_isdst = -1;
+  *time = (int64_t) mktime(&parsed);
+  return true;
+}
+
+std::string ReadFixture(const char *name) {
+  std::string path = std::string(FIXTURES_DIR) + name;
+  std::string contents;
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == NULL) {
+    printf("Could not open %s\n", path.c_str());
+    return contents;
+  }
+  char buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof buffer, f)) > 0) {
+    contents.append(buffer, read);
+  }
+  fclose(f);
+  return contents;
+}
+
+double MonotonicUs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
@@ -0,0 +1,35 @@
+/**
+ *  @filename   :   reference.h
+ *  @brief      :   Header file for straightforward versions of the optimized kernels and parsers,
+ *                  which tests.cpp checks them against and bench.cpp times them against
+ *  
+ */
+
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "frameops.h"
+
+unsigned int DiffFramesBytewise(const unsigned char *old_frame, const unsigned char *new_frame,
+                                unsigned int row_bytes, unsigned int stride, unsigned int height,
+                                unsigned int gap_bytes, std::vector<DirtySpan> &spans);
+
+void ConvertCairoA1ToPanelBitwise(const unsigned char *cairo_data, unsigned char *panel_data, unsigned int bytes);
+bool ParseEventTimeStrptime(const char *value, size_t length, bool date, int64_t *time);
+
+// Responses recorded for the tests and benchmarks, relative to the repository (make runs there)
+#ifndef FIXTURES_DIR
+#define FIXTURES_DIR "code/fixtures/"
+#endif
+
+// The contents of FIXTURES_DIR name, empty (with a message) if it can't be read
+std::string ReadFixture(const char *name);
+
+// Microseconds on a monotonic clock, for timing
+double MonotonicUs(void);
+
+#endif
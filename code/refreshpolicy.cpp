@@ -0,0 +1,175 @@
+/**
+ *  @filename   :   refreshpolicy.cpp
+ *  @brief      :   Policies that decide how Screen refreshes a new frame
+ */
+
+#include <string.h>
+#include "refreshpolicy.h"
+
+/**
+ *  @brief: the fast partial refresh for a region making the given transitions. A region where
+ *          pixels only go one way gets a waveform that drives just those, in a single pass;
+ *          mixed regions need the bvz waveform, twice, for the pixels to stick
+ */
+static RefreshWindow FastWindow(const DirtyRect &rect, const TransitionCount &transitions) {
+  RefreshWindow window = { rect, WAVEFORM_BVZ, 2 };
+  if (transitions.to_white == 0) {
+    window.waveform = WAVEFORM_BVZ_ADD;
+    window.passes = 1;
+  } else if (transitions.to_black == 0) {
+    window.waveform = WAVEFORM_BVZ_SUB;
+    window.passes = 1;
+  }
+  return window;
+}
+
+static bool IsFastWaveform(EpdWaveform waveform) {
+  return waveform == WAVEFORM_BVZ || waveform == WAVEFORM_BVZ_ADD || waveform == WAVEFORM_BVZ_SUB;
+}
+
+const char * DefaultRefreshPolicy::Name(void) const {
+  return "default";
+}
+
+void DefaultRefreshPolicy::Plan(const RefreshSummary &summary, RefreshPlan &plan) {
+  plan.full = false;
+  plan.windows.clear();
+  unsigned int area = summary.width * summary.height;
+  bool cleanupDue = 2 * summary.hot_area > area && !summary.red_on_screen;
+  if (2 * summary.dirty_area > area || cleanupDue) {
+    // If dirty area (or the area due a cleanup) is > 50% of display area, do a full refresh
+    plan.full = true;
+    return;
+  }
+  PlanPartial(summary, plan);
+}
+
+/**
+ *  @brief: one fast partial window per dirty rect, and one cleanup pass over each hot region,
+ *          which also takes care of the dirty rects touching it
+ */
+void DefaultRefreshPolicy::PlanPartial(const RefreshSummary &summary, RefreshPlan &plan) {
+  const std::vector<DirtyRect> &dirty = *summary.dirty_rects;
+  const std::vector<DirtyRect> &hot = *summary.hot_rects;
+
+  cleanup_rects.assign(hot.begin(), hot.end());
+  for (size_t r = 0; r < dirty.size(); r++) {
+    for (size_t h = 0; h < hot.size(); h++) {
+      if (RectsOverlap(dirty[r], hot[h])) {
+        cleanup_rects.push_back(dirty[r]);
+        break;
+      }
+    }
+  }
+  MergeRects(cleanup_rects, PARTIAL_REFRESH_COST_US, PARTIAL_SPI_COST_US_PER_BYTE + PARTIAL_WEAR_COST_US_PER_BYTE,
+      MAX_DIRTY_RECTS);
+
+  for (size_t r = 0; r < dirty.size(); r++) {
+    bool cleaned = false;
+    for (size_t h = 0; h < cleanup_rects.size() && !cleaned; h++) {
+      cleaned = RectContains(cleanup_rects[h], dirty[r]);
+    }
+    if (!cleaned) {
+      plan.windows.push_back(FastWindow(dirty[r], (*summary.transitions)[r]));
+    }
+  }
+  for (size_t h = 0; h < cleanup_rects.size(); h++) {
+    RefreshWindow window = { cleanup_rects[h], WAVEFORM_CLEANUP, 1 };
+    plan.windows.push_back(window);
+  }
+}
+
+CostModelRefreshPolicy::CostModelRefreshPolicy() {
+  // Sized for the most windows a frame can have, so planning doesn't allocate
+  merged_rects.reserve(MaxFrameSpans(EPD_WIDTH, EPD_HEIGHT, DIRTY_SPAN_GAP_BYTES));
+}
+
+const char * CostModelRefreshPolicy::Name(void) const {
+  return "cost";
+}
+
+static unsigned long SpiNsPerByte(const EpdTiming &timing) {
+  return timing.spi_ns_per_byte != 0 ? timing.spi_ns_per_byte : ESTIMATED_SPI_NS_PER_BYTE;
+}
+
+static unsigned long PassUs(const EpdTiming &timing, EpdWaveform waveform) {
+  if (timing.partial_refresh_us[waveform] != 0) {
+    return timing.partial_refresh_us[waveform];
+  }
+  return waveform == WAVEFORM_CLEANUP ? ESTIMATED_CLEANUP_PASS_US : ESTIMATED_PARTIAL_PASS_US;
+}
+
+void CostModelRefreshPolicy::Plan(const RefreshSummary &summary, RefreshPlan &plan) {
+  plan.full = false;
+  plan.windows.clear();
+  if (summary.red_on_screen) {
+    // A full refresh would take the colour waveform, far longer than anything measured here
+    DefaultRefreshPolicy::Plan(summary, plan);
+    return;
+  }
+  if (2 * summary.hot_area > summary.width * summary.height) {
+    plan.full = true;
+    return;
+  }
+  PlanPartial(summary, plan);
+  if (plan.windows.empty()) {
+    return;
+  }
+
+  // Re-merge the fast windows with what a window and a byte actually cost on this panel.
+  // Wear isn't measured, so it keeps its fixed price
+  const EpdTiming &timing = *summary.timing;
+  const unsigned long spiNs = SpiNsPerByte(timing);
+  const unsigned long fastPassUs = PassUs(timing, WAVEFORM_BVZ);
+  merged_rects.clear();
+  size_t kept = 0;
+  for (size_t w = 0; w < plan.windows.size(); w++) {
+    if (IsFastWaveform(plan.windows[w].waveform)) {
+      merged_rects.push_back(plan.windows[w].rect);
+    } else {
+      plan.windows[kept++] = plan.windows[w];
+    }
+  }
+  plan.windows.resize(kept);
+  MergeRects(merged_rects, 2 * fastPassUs, 2 * spiNs / 1000 + PARTIAL_WEAR_COST_US_PER_BYTE, MAX_DIRTY_RECTS);
+  // A merged window makes the transitions of every dirty rect inside it
+  const std::vector<DirtyRect> &dirty = *summary.dirty_rects;
+  for (size_t r = 0; r < merged_rects.size(); r++) {
+    TransitionCount transitions = { 0, 0 };
+    for (size_t d = 0; d < dirty.size(); d++) {
+      if (RectContains(merged_rects[r], dirty[d])) {
+        transitions.to_black += (*summary.transitions)[d].to_black;
+        transitions.to_white += (*summary.transitions)[d].to_white;
+      }
+    }
+    plan.windows.insert(plan.windows.begin() + r, FastWindow(merged_rects[r], transitions));
+  }
+
+  // Compare how long the panel stays busy either way
+  unsigned long partialUs = 0;
+  for (size_t w = 0; w < plan.windows.size(); w++) {
+    const RefreshWindow &window = plan.windows[w];
+    unsigned long bytes = window.rect.width / 8 * window.rect.height;
+    partialUs += window.passes * (PassUs(timing, window.waveform) + bytes * spiNs / 1000);
+  }
+  unsigned long fullUs = timing.refresh_us[WAVEFORM_FULL] != 0 ? timing.refresh_us[WAVEFORM_FULL] : ESTIMATED_FULL_REFRESH_US;
+  // Both planes are sent for a full refresh
+  fullUs += 2 * summary.width / 8 * summary.height * spiNs / 1000;
+  if (fullUs < partialUs) {
+    plan.full = true;
+    plan.windows.clear();
+  }
+}
+
+/**
+ *  @brief: the policy called name ("default" or "cost"), NULL if there is none
+ */
+RefreshPolicy * CreateRefreshPolicy(const char *name) {
+  if (strcmp(name, "default") == 0) {
+    return new DefaultRefreshPolicy();
+  }
+  if (strcmp(name, "cost") == 0) {
+    return new CostModelRefreshPolicy();
+  }
+  return NULL;
+}
@@ -0,0 +1,108 @@
+/**
+ *  @filename   :   refreshpolicy.h
+ *  @brief      :   Header file for the policies that decide how Screen refreshes a new frame
+ *  
+ */
+
+#ifndef REFRESHPOLICY_H
+#define REFRESHPOLICY_H
+
+// Fixed cost model, in microseconds, used to merge dirty regions (see MergeRects). Every partial
+// window pays for its refreshes, and each byte inside it pays for being sent over SPI and for
+// the wear of being driven. A frame is refreshed as at most MAX_DIRTY_RECTS partial windows
+#define PARTIAL_REFRESH_COST_US 2000000
+#define PARTIAL_SPI_COST_US_PER_BYTE 8
+#define PARTIAL_WEAR_COST_US_PER_BYTE 500
+#define MAX_DIRTY_RECTS 8
+
+// Dirty regions: rows are split into separate spans at runs of this many clean bytes
+#define DIRTY_SPAN_GAP_BYTES 4
+
+// What CostModelRefreshPolicy assumes until the panel has been measured (see EpdTiming)
+#define ESTIMATED_FULL_REFRESH_US 4000000
+#define ESTIMATED_PARTIAL_PASS_US 1000000
+#define ESTIMATED_CLEANUP_PASS_US 3600000
+#define ESTIMATED_SPI_NS_PER_BYTE 4100
+
+#include <time.h>
+#include <vector>
+#include "epd4in2b.h"
+#include "frameops.h"
+#include "ghosting.h"
+
+// Pixels a dirty region turns black and turns white
+struct TransitionCount {
+    unsigned int to_black;
+    unsigned int to_white;
+};
+
+// What a policy gets to decide on: how the new frame differs from the screen, and the panel's state
+struct RefreshSummary {
+    unsigned int width;
+    unsigned int height;
+    time_t now;
+    int minute_of_day;                                  // local time
+    unsigned int changed_pixels;
+    const std::vector<DirtyRect> *dirty_rects;          // disjoint, merged with the fixed cost model
+    const std::vector<TransitionCount> *transitions;    // one per dirty rect
+    unsigned int dirty_area;
+    const std::vector<DirtyRect> *hot_rects;            // where the ghosting model wants a cleanup
+    unsigned int hot_area;
+    bool red_on_screen;                                 // a full refresh would be a colour refresh
+    const GhostingModel *ghosting;                      // already charged with the dirty rects
+    const EpdTiming *timing;
+};
+
+struct RefreshWindow {
+    DirtyRect rect;
+    EpdWaveform waveform;
+    int passes;
+};
+
+// Either one full refresh, or partial windows refreshed in order. Screen refreshes any dirty
+// rect a partial plan leaves out with the default waveform, so the screen always ends up
+// showing the new frame; windows with WAVEFORM_CLEANUP count as cleaning the cells they cover
+struct RefreshPlan {
+    bool full;
+    std::vector<RefreshWindow> windows;
+};
+
+class RefreshPolicy {
+public:
+    virtual ~RefreshPolicy() {}
+    virtual const char * Name(void) const = 0;
+    virtual void Plan(const RefreshSummary &summary, RefreshPlan &plan) = 0;
+};
+
+// Partial refreshes of the dirty regions, a single pass where pixels only go one way, a cleanup
+// pass where ghosting has built up, and a full refresh when either the changes or the ghosting
+// cover more than half the screen. Ghosting waits while there's red: that would be a colour refresh
+class DefaultRefreshPolicy : public RefreshPolicy {
+public:
+    const char * Name(void) const;
+    void Plan(const RefreshSummary &summary, RefreshPlan &plan);
+
+protected:
+    void PlanPartial(const RefreshSummary &summary, RefreshPlan &plan);
+
+private:
+    std::vector<DirtyRect> cleanup_rects;
+};
+
+// Picks whichever of the partial plan and a full refresh keeps the panel busy for less time,
+// estimated from the SPI and refresh durations measured on the panel, and merges partial
+// windows by the same estimates. Still a full refresh when ghosting covers half the screen, and
+// never one while there's red, unless the default policy would do one too
+class CostModelRefreshPolicy : public DefaultRefreshPolicy {
+public:
+    CostModelRefreshPolicy();
+    const char * Name(void) const;
+    void Plan(const RefreshSummary &summary, RefreshPlan &plan);
+
+private:
+    std::vector<DirtyRect> merged_rects;
+};
+
+RefreshPolicy * CreateRefreshPolicy(const char *name);
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ *  @filename   :   replay.cpp
+ *  @brief      :   Replays recorded frames through Screen on the simulated panel, once per
+ *                  refresh policy, and reports how each one drove the panel
+ *
+ *  Record frames by running upNext with UPNEXT_RECORD_FRAMES set to a file, then:
+ *      make replay
+ *      bin/replay frames.rec default cost
+ *  Modelled time is used throughout, so replaying a day takes seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include "screen.h"
+#include "epdif_sim.h"
+
+int replay(const char *path, RefreshPolicy *policy) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("Could not open %s\n", path);
+        return -1;
+    }
+
+    Screen screen;
+    if (screen.Init() != 0) {
+        fclose(f);
+        return -1;
+    }
+    screen.SetRefreshPolicy(policy);
+    screen.SetClockRegion(CLOCK_REGION);
+    // The panel starts out clean as of the first frame, in recorded time like everything after it
+    FrameRecordHeader header;
+    time_t start = fread(&header, sizeof header, 1, f) == 1 ? (time_t) header.rendered_at : time(0);
+    rewind(f);
+    screen.Clear(start);
+    EpdSimResetStats();
+
+    cairo_surface_t *surface = screen.GetCairoSurface();
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    const int stride = cairo_image_surface_get_stride(surface);
+    const int height = cairo_image_surface_get_height(surface);
+    unsigned int frames = 0;
+    while (fread(&header, sizeof header, 1, f) == 1) {
+        if (header.magic != FRAME_RECORD_MAGIC || header.stride != (uint32_t) stride ||
+            header.height != (uint32_t) height) {
+            printf("%s is not a recording for this display\n", path);
+            break;
+        }
+        if (fread(data, stride * height, 1, f) != 1) {
+            break;
+        }
+        cairo_surface_mark_dirty(surface);
+        screen.Render((time_t) header.rendered_at);
+        frames++;
+    }
+    fclose(f);
+
+    const EpdSimStats &stats = EpdSimGetStats();
+    std::cerr << policy->Name() << ": " << frames << " frames, "
+        << stats.full_refreshes << " full refreshes, "
+        << stats.partial_refreshes << " partial refresh passes, "
+        << stats.busy_ns / 1000000 << "ms flashing, "
+        << stats.spi_ns / 1000000 << "ms on SPI" << std::endl;
+    screen.Cleanup();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("usage: %s <recording> [policy...]\n", argv[0]);
+        return -1;
+    }
+    // Don't sleep through the modelled time, unless asked to
+    setenv("EPD_SIM_TIME_SCALE", "0", 0);
+
+    int first = 2;
+    const char *all[] = { "default", "cost" };
+    const char **names = (const char **) argv;
+    int count = argc;
+    if (argc == 2) {
+        names = all;
+        first = 0;
+        count = 2;
+    }
+    for (int i = first; i < count; i++) {
+        RefreshPolicy *policy = CreateRefreshPolicy(names[i]);
+        if (policy == NULL) {
+            printf("Unknown refresh policy %s\n", names[i]);
+            return -1;
+        }
+        int result = replay(argv[1], policy);
+        delete policy;
+        if (result != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
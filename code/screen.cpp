@@ -5,14 +5,80 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>     // fsync
 #include <iostream>
 #include "screen.h"
 #include "epd4in2b.h"
 #include <algorithm>    // std::min
 
+FrameArena::FrameArena() {
+  base = NULL;
+  size = 0;
+  used = 0;
+}
+
+FrameArena::~FrameArena() {
+  free(base);
+}
+
+/**
+ *  @brief: allocates the arena, returns false if that failed
+ */
+bool FrameArena::Reserve(size_t bytes) {
+  free(base);
+  base = NULL;
+  size = used = 0;
+  void *memory;
+  if (posix_memalign(&memory, ARENA_ALIGNMENT, bytes) != 0) {
+    return false;
+  }
+  base = (unsigned char *) memory;
+  size = bytes;
+  return true;
+}
+
+/**
+ *  @brief: hands out the next aligned, zeroed chunk of the arena, NULL if it doesn't fit
+ */
+unsigned char * FrameArena::Carve(size_t bytes) {
+  size_t rounded = (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+  if (base == NULL || used + rounded > size) {
+    return NULL;
+  }
+  unsigned char *chunk = base + used;
+  used += rounded;
+  memset(chunk, 0, bytes);
+  return chunk;
+}
+
+// Layout of the state file: this header, then screen_data, red_screen_data, then the ghosting
+// model's wear map, run-length encoded (see GhostingModel::Save)
+struct ScreenStateHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t full_refreshes;
+  uint32_t partial_refreshes;
+  uint32_t exiting;         // saved by Cleanup: the panel shows just this
+  int64_t saved_at;
+  int64_t last_wipe_at;
+};
+
 Screen::Screen() {
   Epd display;
+  last_wipe_at = 0;
+  full_refreshes = 0;
+  partial_refreshes = 0;
+  policy = &default_policy;
+  record_file = NULL;
+  temperature_read_at = 0;
+  state_saved_at = 0;
+  full_refresh_due = false;
+  memset(&clock_region, 0, sizeof clock_region);
 };
 
 int Screen::Init(void) {
@@ -21,12 +87,38 @@ int Screen::Init(void) {
         return -1;
     }
 
+    // All of the frame memory comes from one arena: the cairo surfaces (the frame being drawn),
+    // screen_data (the frame on the screen), both for black and red, and the wear map
     cairo_stride = cairo_format_stride_for_width (CAIRO_FORMAT_A1, display.width);
-    cairo_image_data = (uint32_t *) malloc (cairo_stride * display.height);
+    const size_t frameBytes = cairo_stride * display.height;
+    const size_t wearBytes = GhostingModel::BytesFor(display.width, display.height);
+    if (!arena.Reserve(4 * (frameBytes + ARENA_ALIGNMENT) + wearBytes + ARENA_ALIGNMENT)) {
+        printf("Screen buffer allocation failed\n");
+        return -1;
+    }
+    cairo_image_data = (uint32_t *) arena.Carve(frameBytes);
+    screen_data = arena.Carve(frameBytes);
+    red_image_data = (uint32_t *) arena.Carve(frameBytes);
+    red_screen_data = arena.Carve(frameBytes);
+    ghosting.Attach((WearCell *) arena.Carve(wearBytes), display.width, display.height);
+    ghosting.MarkAllClean(time(0));
+
     cairo_surface = cairo_image_surface_create_for_data ((unsigned char *) cairo_image_data, CAIRO_FORMAT_A1, display.width, display.height, cairo_stride);
+    red_surface = cairo_image_surface_create_for_data ((unsigned char *) red_image_data, CAIRO_FORMAT_A1, display.width, display.height, cairo_stride);
+    // The display takes frames straight from cairo, and converts what it sends
+    display.SetFrameFormat(FRAME_FORMAT_CAIRO_A1, cairo_stride);
 
-    screen_data = (unsigned char *) malloc (sizeof *screen_data * display.width * display.height / 8);
-    partial_budget = (uint8_t *) malloc (sizeof *partial_budget * display.width * display.height / 8);
+    // Worst case: a span, and so a rect, for every changed byte with a gap after it. Colour
+    // rects and windows can come from both the black and the red plane
+    const size_t maxSpans = MaxFrameSpans(display.width, display.height, DIRTY_SPAN_GAP_BYTES);
+    dirty_spans.reserve(maxSpans);
+    dirty_rects.reserve(maxSpans);
+    hot_spans.reserve(maxSpans);
+    hot_rects.reserve(maxSpans);
+    transitions.reserve(maxSpans);
+    red_spans.reserve(maxSpans);
+    color_rects.reserve(2 * maxSpans);
+    plan.windows.reserve(2 * maxSpans);
     return 0;
 }
 
@@ -34,14 +126,24 @@ int Screen::Init(void) {
  *  @brief: clears the screen and associated cairo surface
  */
 void Screen::Clear(void) {
+  Clear(time(0));
+}
+
+/**
+ *  @brief: clears the screen as of now, which is when the ghosting model counts it clean from
+ */
+void Screen::Clear(time_t now) {
   display.ClearFrame();
   display.DisplayFrame();
 
   // Erase image data as well
   memset(cairo_image_data, 0, cairo_stride * display.height);
-  memset(screen_data, 0xFF, sizeof *screen_data * display.width * display.height / 8);
-  ClearPartialBudget();
+  memset(screen_data, 0, cairo_stride * display.height);
+  memset(red_image_data, 0, cairo_stride * display.height);
+  memset(red_screen_data, 0, cairo_stride * display.height);
+  ghosting.MarkAllClean(now);
   cairo_surface_mark_dirty(cairo_surface);
+  cairo_surface_mark_dirty(red_surface);
 }
 
 void Screen::HardWipe(void) {
@@ -52,143 +154,619 @@ void Screen::HardWipe(void) {
   }
   // Do other cleanup stuff
   Clear();
+  last_wipe_at = time(0);
+  full_refreshes = 0;
+  partial_refreshes = 0;
+  SaveState(false);
 }
 
 cairo_surface_t * Screen::GetCairoSurface(void) {
   return cairo_surface;
 }
 
+/**
+ *  @brief: the surface to draw red on, same size and format as GetCairoSurface. Red is shown
+ *          on top of black; regions with red in them take a slow, colour refresh
+ */
+cairo_surface_t * Screen::GetRedCairoSurface(void) {
+  return red_surface;
+}
+
 void Screen::FullRerender(void) {
   // Naive - re-renders the whole screen.
   // A better way to do this is to calculate which parts
   // have changed and do a partial update
   cairo_surface_flush(cairo_surface);
-  ComputeScreenDataFromCairoData(cairo_image_data, screen_data);
-  display.DisplayFrame(screen_data);
-  ClearPartialBudget();
-}
-
-unsigned int reverseBits(unsigned int num)
-{
-    unsigned int count = sizeof(num) * 8 - 1;
-    unsigned int reverse_num = num;
-     
-    num >>= 1; 
-    while(num)
-    {
-       reverse_num <<= 1;       
-       reverse_num |= num & 1;
-       num >>= 1;
-       count--;
-    }
-    reverse_num <<= count;
-    return reverse_num;
-}
-
-void Screen::ComputeScreenDataFromCairoData(uint32_t *cairo_source_buffer, unsigned char *destination_buffer) {
-  // Takes the stride-offset, int32_t data from cairo
-  // and turns it into the width x height, 8-bit data that goes directly
-  // onto the screen
-  unsigned int i = 0;
-  for(unsigned int row = 0; row < display.height; row++) {
-    for(unsigned int col = 0; col < display.width; col += 32) {
-      // Stride, annoyingly, is given by cairo in # of 8-bit blocks,
-      // even though data is stored in 32 bit blocks
-      uint32_t data = cairo_source_buffer[(row * cairo_stride * 8 + col)/ 32];
-      // The screen data comes from cairo in 32-bit, little-endian blocks
-      // (first pixel is last bit), which is super weird, so we fix it
-      data = reverseBits(data);
-
-      for (int bitOffset = 0; bitOffset < 32; bitOffset += 8){
-        if (col + bitOffset >= display.width) {
-          // Don't write past edge of screen, or we'll offset the next line
-          continue;
-        }
-        // Write most significant byte first
-        char byte = (data >> (24 - bitOffset)) & 0xFF;
-        // Flip bits - for screen, 0 is dark and 1 is light
-        destination_buffer[i] = byte ^ 0xFF;
-        i++;
-      }
-    }
+  cairo_surface_flush(red_surface);
+  memcpy(screen_data, cairo_image_data, cairo_stride * display.height);
+  memcpy(red_screen_data, red_image_data, cairo_stride * display.height);
+  DirtyRect all = { 0, 0, (unsigned int) display.width, (unsigned int) display.height };
+  if (HasRed(red_screen_data, all)) {
+    display.DisplayColorWindow(screen_data, red_screen_data, 0, 0, display.width, display.height);
+  } else {
+    display.DisplayFrame(screen_data);
   }
+  ghosting.MarkAllClean(time(0));
+  full_refreshes++;
+  full_refresh_due = false;
+  SaveState(false);
 }
 
 void Screen::Render(void) {
+  Render(time(0));
+}
+
+// Counts the pixels of rect that go from white to black and from black to white
+static TransitionCount CountTransitions(const unsigned char *old_frame, const unsigned char *new_frame,
+                                        unsigned int stride, const DirtyRect &rect) {
+  TransitionCount count = { 0, 0 };
+  for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+    for (unsigned int c = rect.x / 8; c < (rect.x + rect.width) / 8; c++) {
+      unsigned char before = old_frame[y * stride + c];
+      unsigned char after = new_frame[y * stride + c];
+      count.to_black += __builtin_popcount(after & ~before & 0xFF);
+      count.to_white += __builtin_popcount(before & ~after & 0xFF);
+    }
+  }
+  return count;
+}
+
+/**
+ *  @brief: refreshes whatever changed since the last Render, as of now. How is up to the
+ *          refresh policy, see SetRefreshPolicy
+ */
+void Screen::Render(time_t now) {
   // Intelligently figures out which parts need to be updated, and does a partial update
   cairo_surface_flush(cairo_surface);
+  cairo_surface_flush(red_surface);
+  CheckTemperature(now);
+
+  // The clock goes first, in its own window, so it never waits for or joins the rest
+  bool clockRefreshed = clock_region.width > 0 && !full_refresh_due && RefreshRegion(clock_region, now);
+
+  // The cairo surface _is_ the new screen data: it gets compared and sent as is,
+  // the display only converts the bytes that go out
+  const unsigned char *new_screen_data = (const unsigned char *) cairo_image_data;
+  const unsigned char *new_red_data = (const unsigned char *) red_image_data;
+
+  // Compare new screen data to existing screen data, and group the "dirty" 8x1 blocks
+  // into a few disjoint rectangles
+  std::vector<DirtyRect> &rects = dirty_rects;
+  unsigned int changedPixels = FindDirtyRects(new_screen_data, rects);
+  if (changedPixels > 0 || clockRefreshed) {
+    RecordFrame(new_screen_data, now);
+  }
+  // Regions where red changes, or black changes next to red, need a colour refresh:
+  // a black/white one would erase the red. That takes them out of rects
+  FindColorRects(new_red_data, rects, color_rects);
+
+  RefreshSummary summary;
+  summary.width = display.width;
+  summary.height = display.height;
+  summary.now = now;
+  struct tm local;
+  localtime_r(&now, &local);
+  summary.minute_of_day = local.tm_hour * 60 + local.tm_min;
+  summary.changed_pixels = changedPixels;
+  summary.dirty_rects = &rects;
+  summary.transitions = &transitions;
+  summary.dirty_area = 0;
+  transitions.clear();
+  for (size_t r = 0; r < rects.size(); r++) {
+    summary.dirty_area += rects[r].width * rects[r].height;
+    transitions.push_back(CountTransitions(screen_data, new_screen_data, cairo_stride, rects[r]));
+    // Charge the refresh to the pixels it flips, a full refresh would wipe the slate anyway
+    ghosting.ChargePartial(screen_data, new_screen_data, cairo_stride, rects[r]);
+  }
+  DirtyRect all = { 0, 0, (unsigned int) display.width, (unsigned int) display.height };
+  summary.red_on_screen = HasRed(new_red_data, all);
+  // Regions where ghosting has built up
+  summary.hot_area = FindHotRects(new_red_data, now, hot_rects);
+  summary.hot_rects = &hot_rects;
+  summary.ghosting = &ghosting;
+  summary.timing = &display.GetTiming();
 
-  // Calculate new screen data, keep it as a separate buffer so we can compare
-  const unsigned int numBlocks = display.width * display.height / 8;
-  unsigned char *new_screen_data = (unsigned char*) malloc (sizeof *new_screen_data * numBlocks);
-  ComputeScreenDataFromCairoData(cairo_image_data, new_screen_data);
-
-  // Compare new screen data to existing screen data, find "dirty" 8x1 blocks
-  // and determine bounding box of "dirty" blocks
-  // We are a bit lazy - we could find multiple minimal bounding boxes,
-  // but we're just going to find the encompasing one
-  // Bounding box = top left: (minDirtyX, minDirtyY); bottom right (maxDirtyX, maxDirtyY)
-  // Initialize to the other extreme
-  unsigned int minDirtyX = display.width;
-  unsigned int minDirtyY = display.height;
-  unsigned int maxDirtyX = 0;
-  unsigned int maxDirtyY = 0;
-
-  for (unsigned int i = 0; i < numBlocks; i++) {
-    if (new_screen_data[i] != screen_data[i]) {
-      unsigned int x = (i * 8) % display.width;
-      unsigned int y = (i * 8) / display.width;
-      // Dirty
-      minDirtyX = std::min(x, minDirtyX);
-      maxDirtyX = std::max(x + 7, maxDirtyX);
-
-      minDirtyY = std::min(y, minDirtyY);
-      maxDirtyY = std::max(y, maxDirtyY);
+  policy->Plan(summary, plan);
+  if (full_refresh_due) {
+    plan.full = true;
+    plan.windows.clear();
+    full_refresh_due = false;
+  }
+  bool fullColor = plan.full && summary.red_on_screen;
+  if (!plan.full) {
+    // Whatever the policy says, every dirty region gets refreshed
+    size_t planned = plan.windows.size();
+    for (size_t r = 0; r < rects.size(); r++) {
+      bool covered = false;
+      for (size_t w = 0; w < planned && !covered; w++) {
+        covered = RectContains(plan.windows[w].rect, rects[r]);
+      }
+      if (!covered) {
+        RefreshWindow window = { rects[r], WAVEFORM_BVZ, 2 };
+        plan.windows.push_back(window);
+      }
+    }
+    // Windows with red in them, merged ones included, turn into colour refreshes as well
+    size_t kept = 0;
+    for (size_t w = 0; w < plan.windows.size(); w++) {
+      if (HasRed(new_red_data, plan.windows[w].rect)) {
+        color_rects.push_back(plan.windows[w].rect);
+      } else {
+        plan.windows[kept++] = plan.windows[w];
+      }
     }
+    plan.windows.resize(kept);
+    MergeRects(color_rects, ColorRefreshCostUs(), 2 * PARTIAL_SPI_COST_US_PER_BYTE, MAX_COLOR_RECTS);
   }
-  
-  int dirtyWidth = maxDirtyX - minDirtyX;
-  int dirtyHeight = maxDirtyY - minDirtyY;
-  if (dirtyWidth < 0 || dirtyHeight < 0) {
+
+  bool refreshed = plan.full || !plan.windows.empty() || !color_rects.empty();
+  if (!refreshed) {
     // No-op
     std::cout << "Not refreshing, because nothing changed" << std::endl;
-  } else if (2 * dirtyWidth * dirtyHeight > display.width * display.height) {
-    // If dirty area is > 50% of display area, do a full refresh
+  } else if (fullColor) {
+    std::cout << "Colour refresh of the whole screen" << std::endl;
+    display.DisplayColorWindow(new_screen_data, new_red_data, 0, 0, display.width, display.height);
+    ghosting.MarkAllClean(now);
+    full_refreshes++;
+  } else if (plan.full) {
     display.DisplayFrame(new_screen_data);
-    ClearPartialBudget();
+    ghosting.MarkAllClean(now);
+    full_refreshes++;
   } else {
-    // Prevent screen burnout by keeping track of when we use partial LUT on a block
-    bool overBudget = false;
-    for (unsigned int x = minDirtyX; x < maxDirtyX; x += 8) {
-      for (unsigned int y = minDirtyY; y < maxDirtyY; y++) {
-        unsigned int i = (x + y * display.width) / 8;
-        partial_budget[i]++;
-        overBudget = overBudget || partial_budget[i] >= MAX_PARTIAL_BUDGET;
+    // Partial updates, one window at a time: the controller refreshes a single window per pass
+    if (changedPixels > 0) {
+      std::cout << changedPixels << " pixels changed" << std::endl;
+    }
+    for (size_t w = 0; w < plan.windows.size(); w++) {
+      const RefreshWindow &window = plan.windows[w];
+      const DirtyRect &rect = window.rect;
+      bool cleanup = window.waveform == WAVEFORM_CLEANUP;
+      std::cout << (cleanup ? "Cleanup" : "Partial") << " refresh of " << rect.width << "x" << rect.height
+        << " at (" << rect.x << "," << rect.y << ")" << std::endl;
+      display.DisplayPartialFrame(new_screen_data, rect.x, rect.y, rect.width, rect.height,
+          window.waveform, window.passes);
+      if (cleanup) {
+        ghosting.ChargeOutside(rect, 1);
+        ghosting.MarkClean(rect, now);
       }
+      partial_refreshes++;
+    }
+    // Colour windows last: they write both planes, whatever ran before them underneath
+    for (size_t c = 0; c < color_rects.size(); c++) {
+      const DirtyRect &rect = color_rects[c];
+      std::cout << "Colour refresh of " << rect.width << "x" << rect.height
+        << " at (" << rect.x << "," << rect.y << ")" << std::endl;
+      display.DisplayColorWindow(new_screen_data, new_red_data, rect.x, rect.y, rect.width, rect.height);
+      ghosting.ChargeOutside(rect, COLOR_WINDOW_OUTSIDE_PASSES);
+      ghosting.MarkClean(rect, now);
+      partial_refreshes++;
+    }
+  }
+
+  UpdateScreenData(new_screen_data, new_red_data);
+  if (refreshed || clockRefreshed) {
+    SaveStateIfDue(now);
+  }
+}
+
+/**
+ *  @brief: refreshes region alone, if it changed since it was last refreshed, and returns
+ *          whether it did. The rest of the surface isn't looked at, and waits for Render,
+ *          unless the panel is due a full refresh: that takes everything along
+ */
+bool Screen::RenderRegion(const DirtyRect &region, time_t now) {
+  if (full_refresh_due) {
+    Render(now);
+    return true;
+  }
+  cairo_surface_flush(cairo_surface);
+  cairo_surface_flush(red_surface);
+  CheckTemperature(now);
+  if (!RefreshRegion(region, now)) {
+    return false;
+  }
+  RecordFrame((const unsigned char *) cairo_image_data, now);
+  SaveStateIfDue(now);
+  return true;
+}
+
+/**
+ *  @brief: waveforms depend on the panel temperature, which changes slowly: reads it again
+ *          if it's been a while
+ */
+void Screen::CheckTemperature(time_t now) {
+  if (now - temperature_read_at >= TEMPERATURE_INTERVAL_S || now < temperature_read_at) {
+    display.UpdateTemperature();
+    temperature_read_at = now;
+  }
+}
+
+/**
+ *  @brief: has Render refresh region (e.g. a clock) on its own, ahead of everything else,
+ *          see RenderRegion. x and width are rounded out to whole bytes
+ */
+void Screen::SetClockRegion(const DirtyRect &region) {
+  clock_region.x = region.x / 8 * 8;
+  clock_region.width = (region.x + region.width + 7) / 8 * 8 - clock_region.x;
+  clock_region.y = region.y;
+  clock_region.height = region.height;
+}
+
+/**
+ *  @brief: refreshes region in a window of its own if anything in it changed, and brings
+ *          screen_data up to date there. The waveform depends on region alone: how its pixels
+ *          change, and whether the ghosting model wants it cleaned up
+ */
+bool Screen::RefreshRegion(const DirtyRect &region, time_t now) {
+  const unsigned char *new_screen_data = (const unsigned char *) cairo_image_data;
+  const unsigned char *new_red_data = (const unsigned char *) red_image_data;
+  TransitionCount transitions = CountTransitions(screen_data, new_screen_data, cairo_stride, region);
+  bool redChanged = false;
+  for (unsigned int y = region.y; y < region.y + region.height && !redChanged; y++) {
+    unsigned int offset = y * cairo_stride + region.x / 8;
+    redChanged = memcmp(red_screen_data + offset, new_red_data + offset, region.width / 8) != 0;
+  }
+  if (transitions.to_black == 0 && transitions.to_white == 0 && !redChanged) {
+    return false;
+  }
+
+  std::cout << "Region refresh of " << region.width << "x" << region.height
+    << " at (" << region.x << "," << region.y << ")" << std::endl;
+  if (HasRed(new_red_data, region)) {
+    display.DisplayColorWindow(new_screen_data, new_red_data, region.x, region.y, region.width, region.height);
+    ghosting.ChargeOutside(region, COLOR_WINDOW_OUTSIDE_PASSES);
+    ghosting.MarkClean(region, now);
+  } else {
+    ghosting.ChargePartial(screen_data, new_screen_data, cairo_stride, region);
+    RefreshWindow window = { region, WAVEFORM_BVZ, 2 };
+    // Like FindHotRects, no cleanup in rows with red
+    DirtyRect rows = { 0, region.y, (unsigned int) display.width, region.height };
+    if (ghosting.IsHot(region, now) && !HasRed(new_red_data, rows)) {
+      window.waveform = WAVEFORM_CLEANUP;
+      window.passes = 1;
+    } else if (transitions.to_white == 0) {
+      window.waveform = WAVEFORM_BVZ_ADD;
+      window.passes = 1;
+    } else if (transitions.to_black == 0) {
+      window.waveform = WAVEFORM_BVZ_SUB;
+      window.passes = 1;
+    }
+    display.DisplayPartialFrame(new_screen_data, region.x, region.y, region.width, region.height,
+        window.waveform, window.passes);
+    if (window.waveform == WAVEFORM_CLEANUP) {
+      ghosting.ChargeOutside(region, 1);
+      ghosting.MarkClean(region, now);
     }
+  }
+  partial_refreshes++;
 
-    if (overBudget) {
-      // If we are over our "budget" of partial updates for any block, do a full refresh
-      display.DisplayFrame(new_screen_data);
-      ClearPartialBudget();
+  for (unsigned int y = region.y; y < region.y + region.height; y++) {
+    unsigned int offset = y * cairo_stride + region.x / 8;
+    memcpy(screen_data + offset, new_screen_data + offset, region.width / 8);
+    memcpy(red_screen_data + offset, new_red_data + offset, region.width / 8);
+  }
+  return true;
+}
+
+/**
+ *  @brief: brings screen_data and red_screen_data up to date. Only the dirty spans found by
+ *          the last FindDirtyRects and FindColorRects differ, so only they are copied
+ */
+void Screen::UpdateScreenData(const unsigned char *new_screen_data, const unsigned char *new_red_data) {
+  for (size_t s = 0; s < dirty_spans.size(); s++) {
+    const DirtySpan &span = dirty_spans[s];
+    unsigned int offset = span.row * cairo_stride + span.first;
+    memcpy(screen_data + offset, new_screen_data + offset, span.last - span.first + 1);
+  }
+  for (size_t s = 0; s < red_spans.size(); s++) {
+    const DirtySpan &span = red_spans[s];
+    unsigned int offset = span.row * cairo_stride + span.first;
+    memcpy(red_screen_data + offset, new_red_data + offset, span.last - span.first + 1);
+  }
+}
+
+/**
+ *  @brief: turns per-row spans (in DiffFrames' byte columns) into rectangles, growing each one
+ *          into a rectangle that reached the previous row and is close to it horizontally,
+ *          or starting a new one
+ */
+static void GrowRects(const std::vector<DirtySpan> &spans, std::vector<DirtyRect> &rects) {
+  rects.clear();
+  for (size_t s = 0; s < spans.size(); s++) {
+    const DirtySpan &dirty = spans[s];
+    DirtyRect span = { dirty.first * 8u, dirty.row, (dirty.last - dirty.first + 1) * 8u, 1 };
+    bool extended = false;
+    for (size_t r = 0; r < rects.size() && !extended; r++) {
+      DirtyRect &rect = rects[r];
+      if (rect.y + rect.height >= span.y &&
+          span.x <= rect.x + rect.width + DIRTY_SPAN_GAP_BYTES * 8 &&
+          rect.x <= span.x + span.width + DIRTY_SPAN_GAP_BYTES * 8) {
+        unsigned int minX = std::min(rect.x, span.x);
+        unsigned int maxX = std::max(rect.x + rect.width, span.x + span.width);
+        rect.x = minX;
+        rect.width = maxX - minX;
+        rect.height = span.y - rect.y + 1;
+        extended = true;
+      }
+    }
+    if (!extended) {
+      rects.push_back(span);
+    }
+  }
+}
+
+/**
+ *  @brief: finds the regions where new_screen_data differs from screen_data,
+ *          returns the number of pixels that changed
+ */
+unsigned int Screen::FindDirtyRects(const unsigned char *new_screen_data, std::vector<DirtyRect> &rects) {
+  const unsigned int rowBytes = display.width / 8;
+  unsigned int changedPixels = DiffFrames(screen_data, new_screen_data, rowBytes, cairo_stride, display.height,
+      DIRTY_SPAN_GAP_BYTES - 1, dirty_spans);
+
+  GrowRects(dirty_spans, rects);
+  MergeRects(rects, PARTIAL_REFRESH_COST_US, PARTIAL_SPI_COST_US_PER_BYTE + PARTIAL_WEAR_COST_US_PER_BYTE,
+      MAX_DIRTY_RECTS);
+  return changedPixels;
+}
+
+/**
+ *  @brief: finds the regions that need a colour refresh, into color: where the red plane
+ *          changed, and the dirty rects that have red in them before or after. Those are
+ *          taken out of rects, which keeps the regions a black/white refresh can handle
+ */
+void Screen::FindColorRects(const unsigned char *new_red_data, std::vector<DirtyRect> &rects,
+                            std::vector<DirtyRect> &color) {
+  const unsigned int rowBytes = display.width / 8;
+  DiffFrames(red_screen_data, new_red_data, rowBytes, cairo_stride, display.height,
+      DIRTY_SPAN_GAP_BYTES - 1, red_spans);
+  GrowRects(red_spans, color);
+
+  size_t kept = 0;
+  for (size_t r = 0; r < rects.size(); r++) {
+    if (HasRed(new_red_data, rects[r])) {
+      color.push_back(rects[r]);
     } else {
-      // Partial update
-      display.DisplayPartialFrame(new_screen_data, minDirtyX, minDirtyY, dirtyWidth + 1, dirtyHeight + 1);
+      rects[kept++] = rects[r];
+    }
+  }
+  rects.resize(kept);
+  // Every window costs a slow refresh, and sends both planes
+  MergeRects(color, ColorRefreshCostUs(), 2 * PARTIAL_SPI_COST_US_PER_BYTE, MAX_COLOR_RECTS);
+}
+
+/**
+ *  @brief: what one colour window costs, as the panel measured it or estimated until it has
+ */
+unsigned long Screen::ColorRefreshCostUs(void) {
+  const EpdTiming &timing = display.GetTiming();
+  return timing.color_refresh_us != 0 ? timing.color_refresh_us : COLOR_REFRESH_COST_US;
+}
+
+/**
+ *  @brief: whether there is red in rect, on the screen now or in new_red_data
+ */
+bool Screen::HasRed(const unsigned char *new_red_data, const DirtyRect &rect) {
+  for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+    for (unsigned int c = rect.x / 8; c < (rect.x + rect.width) / 8; c++) {
+      if (red_screen_data[y * cairo_stride + c] != 0 || new_red_data[y * cairo_stride + c] != 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ *  @brief: finds the regions the ghosting model wants cleaned up, returns their total area.
+ *          Those in rows with red are left for when the red is gone: a cleanup there would
+ *          be a slow colour refresh, and a black/white one drives the whole row (see
+ *          GhostingModel::ChargeOutside)
+ */
+unsigned int Screen::FindHotRects(const unsigned char *new_red_data, time_t now, std::vector<DirtyRect> &rects) {
+  ghosting.FindHotSpans(now, DIRTY_SPAN_GAP_BYTES, hot_spans);
+  GrowRects(hot_spans, rects);
+  MergeRects(rects, PARTIAL_REFRESH_COST_US, PARTIAL_SPI_COST_US_PER_BYTE + PARTIAL_WEAR_COST_US_PER_BYTE,
+      MAX_DIRTY_RECTS);
+
+  unsigned int area = 0;
+  size_t kept = 0;
+  for (size_t r = 0; r < rects.size(); r++) {
+    DirtyRect rows = { 0, rects[r].y, (unsigned int) display.width, rects[r].height };
+    if (HasRed(new_red_data, rows)) {
+      continue;
     }
+    area += rects[r].width * rects[r].height;
+    rects[kept++] = rects[r];
   }
+  rects.resize(kept);
+  return area;
+}
 
-  // Update screen data with new data
-  free(screen_data);
-  screen_data = new_screen_data;
+/**
+ *  @brief: sets where the screen contents and wear record are persisted, see RestoreState
+ */
+void Screen::SetStateFile(const char *path) {
+  state_path = path;
+  state_tmp_path = state_path + ".tmp";
 }
 
-void Screen::ClearPartialBudget(void) {
-    memset(partial_budget, 0, sizeof *partial_budget * display.width * display.height / 8);
+/**
+ *  @brief: saves the state if it's been STATE_SAVE_INTERVAL_S since the last time. Every save
+ *          rewrites the whole file, too much wear on the SD card to do on every refresh
+ */
+void Screen::SaveStateIfDue(time_t now) {
+  if (now - state_saved_at >= STATE_SAVE_INTERVAL_S || now < state_saved_at) {
+    state_saved_at = now;
+    SaveState(false);
+  }
 }
+
+/**
+ *  @brief: writes what's on the screen, the wear map and the wear record to the state file,
+ *          exiting when the panel won't be refreshed again before the next run restores it.
+ *          Goes through a temporary file, so a crash never leaves a half-written state behind
+ */
+void Screen::SaveState(bool exiting) {
+  if (state_path.empty()) {
+    return;
+  }
+  ScreenStateHeader header;
+  memset(&header, 0, sizeof header);
+  header.magic = STATE_FILE_MAGIC;
+  header.version = STATE_FILE_VERSION;
+  header.width = display.width;
+  header.height = display.height;
+  header.stride = cairo_stride;
+  header.full_refreshes = full_refreshes;
+  header.partial_refreshes = partial_refreshes;
+  header.exiting = exiting;
+  header.saved_at = time(0);
+  header.last_wipe_at = last_wipe_at;
+
+  FILE *f = fopen(state_tmp_path.c_str(), "wb");
+  if (f == NULL) {
+    std::cout << "Could not write screen state to " << state_tmp_path << std::endl;
+    return;
+  }
+  bool ok = fwrite(&header, sizeof header, 1, f) == 1 &&
+    fwrite(screen_data, cairo_stride * display.height, 1, f) == 1 &&
+    fwrite(red_screen_data, cairo_stride * display.height, 1, f) == 1 &&
+    ghosting.Save(f);
+  // On disk before the rename, or a power cut can leave an empty file in place of the old state
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(state_tmp_path.c_str(), state_path.c_str()) != 0) {
+    std::cout << "Could not write screen state to " << state_path << std::endl;
+    remove(state_tmp_path.c_str());
+  }
+}
+
+/**
+ *  @brief: picks up where a previous run left off, so a restart doesn't need a HardWipe.
+ *          Loads what the screen is showing and its wear record from the state file, and
+ *          returns true if it is usable: present, for this display, recent, and not due a wipe.
+ *          The controller's SRAM is reloaded with the frame, without refreshing the panel
+ */
+bool Screen::RestoreState(void) {
+  if (state_path.empty()) {
+    return false;
+  }
+  FILE *f = fopen(state_path.c_str(), "rb");
+  if (f == NULL) {
+    std::cout << "No screen state at " << state_path << ", wiping" << std::endl;
+    return false;
+  }
+
+  ScreenStateHeader header;
+  const size_t frameBytes = cairo_stride * display.height;
+  bool ok = fread(&header, sizeof header, 1, f) == 1 &&
+    header.magic == STATE_FILE_MAGIC && header.version == STATE_FILE_VERSION &&
+    header.width == display.width && header.height == display.height &&
+    header.stride == (uint32_t) cairo_stride;
+  // Read into the cairo surface first, so a truncated file doesn't leave screen_data half updated
+  ok = ok && fread(cairo_image_data, frameBytes, 1, f) == 1 &&
+    fread(red_image_data, frameBytes, 1, f) == 1 &&
+    ghosting.Load(f);
+  fclose(f);
+  if (!ok) {
+    std::cout << "Screen state at " << state_path << " is unreadable, wiping" << std::endl;
+    ghosting.MarkAllClean(time(0));
+    return false;
+  }
+
+  time_t now = time(0);
+  if (now - header.saved_at > STATE_MAX_AGE_S || now < header.saved_at) {
+    std::cout << "Screen state is stale, wiping" << std::endl;
+    return false;
+  }
+  if (now - header.last_wipe_at > WIPE_MAX_INTERVAL_S ||
+      header.full_refreshes + header.partial_refreshes > WIPE_MAX_REFRESHES) {
+    std::cout << "Screen is due a wipe" << std::endl;
+    return false;
+  }
+
+  memcpy(screen_data, cairo_image_data, frameBytes);
+  memcpy(red_screen_data, red_image_data, frameBytes);
+  memset(cairo_image_data, 0, frameBytes);
+  memset(red_image_data, 0, frameBytes);
+  cairo_surface_mark_dirty(cairo_surface);
+  cairo_surface_mark_dirty(red_surface);
+  last_wipe_at = header.last_wipe_at;
+  full_refreshes = header.full_refreshes;
+  partial_refreshes = header.partial_refreshes;
+
+  // The panel still shows this frame, but the controller was reset: give it the frame back
+  display.SetFrame(screen_data);
+  std::cout << "Restored screen state, " << full_refreshes << " full and " << partial_refreshes
+    << " partial refreshes since the last wipe" << std::endl;
+  if (!header.exiting) {
+    // Refreshes since the last save went unrecorded, partial ones would go by the wrong frame
+    std::cout << "Screen state may be behind the panel, refreshing it fully" << std::endl;
+    full_refresh_due = true;
+  }
+  return true;
+}
+
+/**
+ *  @brief: loads the waveforms to use by temperature band, see Epd::LoadWaveformFile
+ */
+int Screen::LoadWaveformFile(const char *path) {
+  display.UpdateTemperature();
+  temperature_read_at = time(0);
+  return display.LoadWaveformFile(path);
+}
+
+/**
+ *  @brief: has Render refresh frames the way policy says, NULL for the default policy.
+ *          The policy is not owned by the Screen
+ */
+void Screen::SetRefreshPolicy(RefreshPolicy *policy) {
+  this->policy = policy != NULL ? policy : &default_policy;
+}
+
+/**
+ *  @brief: appends every frame that Render finds changed to the file at path, with the time
+ *          it was rendered, so a day of frames can be replayed (see replay.cpp)
+ */
+void Screen::SetRecordFile(const char *path) {
+  if (record_file != NULL) {
+    fclose(record_file);
+  }
+  record_file = fopen(path, "ab");
+  if (record_file == NULL) {
+    std::cout << "Could not record frames to " << path << std::endl;
+  }
+}
+
+void Screen::RecordFrame(const unsigned char *frame, time_t now) {
+  if (record_file == NULL) {
+    return;
+  }
+  FrameRecordHeader header;
+  header.magic = FRAME_RECORD_MAGIC;
+  header.width = display.width;
+  header.height = display.height;
+  header.stride = cairo_stride;
+  header.rendered_at = now;
+  if (fwrite(&header, sizeof header, 1, record_file) != 1 ||
+      fwrite(frame, cairo_stride * display.height, 1, record_file) != 1) {
+    std::cout << "Could not record frame, not recording any more" << std::endl;
+    fclose(record_file);
+    record_file = NULL;
+    return;
+  }
+  fflush(record_file);
+}
+
 void Screen::Cleanup(void) {
+  SaveState(true);
   display.Sleep();
+  if (record_file != NULL) {
+    fclose(record_file);
+    record_file = NULL;
+  }
   cairo_surface_destroy (cairo_surface);
-  free(cairo_image_data);
-  free(screen_data);
-  free(partial_budget);
+  cairo_surface_destroy (red_surface);
+  // The frame buffers belong to the arena, and go with the Screen
 }
@@ -8,11 +8,75 @@
 #ifndef SCREEN_H
 #define SCREEN_H
 
-#define MAX_PARTIAL_BUDGET 10
+// Persisted screen state (see Screen::RestoreState). A restart only skips the hard wipe
+// if the state was saved recently, and the panel hasn't gone too long or through too
+// many refreshes since its last wipe. Render saves the state at most every STATE_SAVE_INTERVAL_S,
+// so unless it was saved on the way out (Cleanup) it may be behind the panel
+#define STATE_FILE_MAGIC 0x53504E55     // "UNPS"
+#define STATE_FILE_VERSION 5
+#define STATE_SAVE_INTERVAL_S (15 * 60)
+#define STATE_MAX_AGE_S (24 * 60 * 60)
+#define WIPE_MAX_INTERVAL_S (7 * 24 * 60 * 60)
+#define WIPE_MAX_REFRESHES 20000
+
+// Colour refreshes use the panel's slow black/white/red waveform: what one costs until the panel
+// has timed one, in the units MergeRects weighs windows in, and how many Render does at most per frame
+#define COLOR_REFRESH_COST_US 15000000
+#define MAX_COLOR_RECTS 2
+// What a colour window does to the cells beside it, in partial passes (see
+// GhostingModel::ChargeOutside): not measured, so enough to have them cleaned up
+#define COLOR_WINDOW_OUTSIDE_PASSES (GHOST_THRESHOLD / GHOST_WEIGHT_DRIVEN)
+
+// How often Render reads the panel temperature to pick its waveforms
+#define TEMPERATURE_INTERVAL_S (10 * 60)
+
+// Frames recorded with Screen::SetRecordFile, replayed by replay.cpp
+#define FRAME_RECORD_MAGIC 0x46504E55   // "UNPF"
 
 #include <pango/pangocairo.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
 #include "epd4in2b.h"
+#include "frameops.h"
+#include "ghosting.h"
+#include "refreshpolicy.h"
+
+// A recorded frame is this header, followed by stride * height bytes in cairo A1 layout
+struct FrameRecordHeader {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    int64_t rendered_at;
+};
+
+// Where main.cpp's draw_clock draws, refreshed on its own on the minute (see
+// Screen::SetClockRegion); replay.cpp refreshes recorded frames the same way
+static const DirtyRect CLOCK_REGION = { 288, 8, 112, 28 };
+
+// Buffers in the arena start on cache line boundaries, which also suits the SIMD kernels
+#define ARENA_ALIGNMENT 64
+
+// One aligned allocation that a Screen carves its buffers out of, released with it
+class FrameArena {
+public:
+    FrameArena();
+    ~FrameArena();
+
+    bool Reserve(size_t bytes);
+    unsigned char * Carve(size_t bytes);
+
+private:
+    FrameArena(const FrameArena&);
+    FrameArena& operator=(const FrameArena&);
+
+    unsigned char *base;
+    size_t size;
+    size_t used;
+};
 
 class Screen {
 public:
@@ -20,22 +84,76 @@ public:
 
     int  Init(void);
     void Clear(void);
+    void Clear(time_t now);
     void HardWipe(void);
     cairo_surface_t * GetCairoSurface(void);
+    cairo_surface_t * GetRedCairoSurface(void);
     void Render(void);
+    void Render(time_t now);
+    bool RenderRegion(const DirtyRect &region, time_t now);
+    void SetClockRegion(const DirtyRect &region);
     void FullRerender(void);
     void Cleanup(void);
+    void SetStateFile(const char *path);
+    bool RestoreState(void);
+    void SetRefreshPolicy(RefreshPolicy *policy);
+    void SetRecordFile(const char *path);
+    int  LoadWaveformFile(const char *path);
 
 private:
     Epd display;
+    FrameArena arena;
     uint32_t *cairo_image_data;
     int cairo_stride;
+    // What is on the screen, in the same (cairo A1) layout as cairo_image_data
     unsigned char *screen_data;
-    uint8_t *partial_budget;
+    // The red plane, drawn and kept the same way: ink is red, on top of the black/white plane
+    uint32_t *red_image_data;
+    unsigned char *red_screen_data;
+    // Where ghosting is building up, decides which regions get a cleanup refresh
+    GhostingModel ghosting;
     cairo_surface_t *cairo_surface;
+    cairo_surface_t *red_surface;
+    // Scratch space for Render, sized once in Init so rendering doesn't allocate
+    std::vector<DirtySpan> dirty_spans;
+    std::vector<DirtyRect> dirty_rects;
+    std::vector<DirtySpan> hot_spans;
+    std::vector<DirtyRect> hot_rects;
+    std::vector<TransitionCount> transitions;
+    std::vector<DirtySpan> red_spans;
+    std::vector<DirtyRect> color_rects;
+    RefreshPlan plan;
+    // Refreshed on its own, ahead of the rest of the frame; no width: none
+    DirtyRect clock_region;
+
+    // Decides how each frame is refreshed, default_policy unless set otherwise
+    DefaultRefreshPolicy default_policy;
+    RefreshPolicy *policy;
+    FILE *record_file;
+
+    // Wear record, persisted along with the screen contents
+    std::string state_path;
+    std::string state_tmp_path;
+    time_t state_saved_at;
+    // Set when the restored state may be behind the panel: the next Render refreshes it fully
+    bool full_refresh_due;
+    time_t last_wipe_at;
+    uint32_t full_refreshes;
+    uint32_t partial_refreshes;
+    time_t temperature_read_at;
 
-    void ComputeScreenDataFromCairoData(uint32_t *cairo_source_buffer, unsigned char *destination_buffer);
-    void ClearPartialBudget();
+    bool RefreshRegion(const DirtyRect &region, time_t now);
+    void CheckTemperature(time_t now);
+    unsigned int FindDirtyRects(const unsigned char *new_screen_data, std::vector<DirtyRect> &rects);
+    unsigned int FindHotRects(const unsigned char *new_red_data, time_t now, std::vector<DirtyRect> &rects);
+    void FindColorRects(const unsigned char *new_red_data, std::vector<DirtyRect> &rects,
+                        std::vector<DirtyRect> &color);
+    bool HasRed(const unsigned char *new_red_data, const DirtyRect &rect);
+    unsigned long ColorRefreshCostUs(void);
+    void UpdateScreenData(const unsigned char *new_screen_data, const unsigned char *new_red_data);
+    void RecordFrame(const unsigned char *frame, time_t now);
+    void SaveState(bool exiting);
+    void SaveStateIfDue(time_t now);
 };
 
 #endif
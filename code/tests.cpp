@@ -0,0 +1,388 @@
+/**
+ *  @filename   :   tests.cpp
+ *  @brief      :   Checks the optimized kernels and parsers against reference.cpp, and the
+ *                  edge cases they have to get right
+ *
+ *      make test
+ *  Exits non-zero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include "event.h"
+#include "frameops.h"
+#include "reference.h"
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+      printf("  FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+      return; \
+    } \
+  } while (0)
+
+static bool SameSpans(const std::vector<DirtySpan> &a, const std::vector<DirtySpan> &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].row != b[i].row || a[i].first != b[i].first || a[i].last != b[i].last ||
+        a[i].changed_pixels != b[i].changed_pixels) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Random frames with a few flipped bits, rows of every width from 1 byte (all tail) up to
+// the display's 50, stride padded like cairo's, and every gap from 0 to 9
+static void TestDiffFramesRandom(void) {
+  const unsigned int height = 40;
+  std::vector<unsigned char> a(64 * height);
+  std::vector<unsigned char> b(64 * height);
+  std::vector<DirtySpan> spans;
+  std::vector<DirtySpan> expected;
+  for (unsigned int row_bytes = 1; row_bytes <= 50; row_bytes++) {
+    unsigned int stride = (row_bytes + 3) / 4 * 4 + (row_bytes % 3);
+    for (unsigned int gap = 0; gap < 10; gap++) {
+      for (size_t i = 0; i < a.size(); i++) {
+        a[i] = rand();
+      }
+      b = a;
+      int flips = rand() % (row_bytes * 2 + 1);
+      for (int f = 0; f < flips; f++) {
+        b[rand() % (stride * height)] ^= 1 << (rand() % 8);
+      }
+      unsigned int changed = DiffFrames(&a[0], &b[0], row_bytes, stride, height, gap, spans);
+      unsigned int expected_changed = DiffFramesBytewise(&a[0], &b[0], row_bytes, stride, height, gap, expected);
+      CHECK(changed == expected_changed, "row_bytes %u gap %u: %u pixels changed, expected %u",
+          row_bytes, gap, changed, expected_changed);
+      CHECK(SameSpans(spans, expected), "row_bytes %u gap %u: %zu spans, expected %zu",
+          row_bytes, gap, spans.size(), expected.size());
+    }
+  }
+}
+
+// Two changed bytes exactly gap_bytes apart (one span) and gap_bytes + 1 apart (two), placed at
+// every column so the pair straddles word boundaries and the row's unaligned tail
+static void TestDiffFramesGapBoundary(void) {
+  const unsigned int row_bytes = 50;
+  unsigned char a[row_bytes];
+  unsigned char b[row_bytes];
+  std::vector<DirtySpan> spans;
+  for (unsigned int gap = 0; gap < 12; gap++) {
+    for (unsigned int apart = gap; apart <= gap + 1; apart++) {
+      for (unsigned int first = 0; first + apart + 1 < row_bytes; first++) {
+        memset(a, 0, sizeof a);
+        memset(b, 0, sizeof b);
+        b[first] = 0x01;
+        b[first + apart + 1] = 0x80;
+        DiffFrames(a, b, row_bytes, row_bytes, 1, gap, spans);
+        if (apart == gap) {
+          CHECK(spans.size() == 1 && spans[0].first == first && spans[0].last == first + apart + 1 &&
+              spans[0].changed_pixels == 2, "gap %u, bytes %u and %u: expected one span", gap, first,
+              first + apart + 1);
+        } else {
+          CHECK(spans.size() == 2 && spans[0].last == first && spans[1].first == first + apart + 1,
+              "gap %u, bytes %u and %u: expected two spans", gap, first, first + apart + 1);
+        }
+      }
+    }
+  }
+}
+
+// Only the last byte of a row that isn't a multiple of 8 wide, and padding beyond row_bytes
+// that differs but must be ignored
+static void TestDiffFramesTail(void) {
+  std::vector<DirtySpan> spans;
+  for (unsigned int row_bytes = 1; row_bytes < 24; row_bytes++) {
+    unsigned char a[32] = { 0 };
+    unsigned char b[32] = { 0 };
+    b[row_bytes - 1] = 0xFF;
+    memset(b + row_bytes, 0xFF, sizeof b - row_bytes);
+    unsigned int changed = DiffFrames(a, b, row_bytes, sizeof a, 1, 0, spans);
+    CHECK(changed == 8 && spans.size() == 1 && spans[0].first == row_bytes - 1 &&
+        spans[0].last == row_bytes - 1, "row_bytes %u: tail byte not found alone", row_bytes);
+  }
+}
+
+// Both conversion paths against the bitwise reference, for every length up to 100 bytes (the
+// 16-byte RBIT blocks, the 8-byte unrolled loop and the tails) at unaligned offsets, and in place
+static void TestConvertCairoA1ToPanel(void) {
+  unsigned char cairo[128];
+  unsigned char panel[128];
+  unsigned char expected[128];
+  void (*convert[])(const unsigned char *, unsigned char *, unsigned int) = {
+    ConvertCairoA1ToPanel, ConvertCairoA1ToPanelGeneric
+  };
+  const char *names[] = { "ConvertCairoA1ToPanel", "ConvertCairoA1ToPanelGeneric" };
+  for (int c = 0; c < 2; c++) {
+    for (int round = 0; round < 20; round++) {
+      for (unsigned int bytes = 0; bytes <= 100; bytes++) {
+        unsigned int offset = rand() % 8;
+        for (unsigned int i = 0; i < sizeof cairo; i++) {
+          cairo[i] = rand();
+        }
+        memset(panel, 0xA5, sizeof panel);
+        ConvertCairoA1ToPanelBitwise(cairo + offset, expected, bytes);
+        convert[c](cairo + offset, panel + offset, bytes);
+        CHECK(memcmp(panel + offset, expected, bytes) == 0, "%s: %u bytes differ from the reference",
+            names[c], bytes);
+        CHECK(panel[offset + bytes] == 0xA5, "%s: %u bytes written past the end", names[c], bytes);
+
+        convert[c](cairo + offset, cairo + offset, bytes);
+        CHECK(memcmp(cairo + offset, expected, bytes) == 0, "%s: %u bytes in place differ from the reference",
+            names[c], bytes);
+      }
+    }
+  }
+}
+
+// A whole frame as Screen converts it, row by row without cairo's stride padding
+static void TestConvertCairoA1ToPanelFrame(void) {
+  const unsigned int row_bytes = 50;
+  const unsigned int stride = 52;
+  const unsigned int height = 300;
+  std::vector<unsigned char> cairo(stride * height);
+  std::vector<unsigned char> panel(row_bytes * height);
+  std::vector<unsigned char> expected(row_bytes * height);
+  for (size_t i = 0; i < cairo.size(); i++) {
+    cairo[i] = rand();
+  }
+  for (unsigned int row = 0; row < height; row++) {
+    ConvertCairoA1ToPanel(&cairo[row * stride], &panel[row * row_bytes], row_bytes);
+    ConvertCairoA1ToPanelBitwise(&cairo[row * stride], &expected[row * row_bytes], row_bytes);
+  }
+  CHECK(panel == expected, "400x300 frame differs from the reference");
+}
+
+static bool ParseTime(const char *value, bool date, int64_t *time) {
+  return ParseEventTime(value, strlen(value), date, time);
+}
+
+// Runs check in a child process with TZ set to zone: ParseEventTime caches local midnights, on
+// the assumption that the zone doesn't change while running
+static void InZone(const char *zone, void (*check)(void)) {
+  fflush(stdout);
+  pid_t child = fork();
+  if (child == 0) {
+    setenv("TZ", zone, 1);
+    tzset();
+    check();
+    fflush(stdout);
+    _exit(failures == 0 ? 0 : 1);
+  }
+  int status = 0;
+  if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("  FAIL in %s\n", zone);
+    failures++;
+  }
+}
+
+// Every way of writing the offset, against unix times worked out with date(1)
+static void TestParseEventTimeOffsets(void) {
+  struct {
+    const char *value;
+    int64_t time;
+  } cases[] = {
+    { "1970-01-01T00:00:00Z", 0 },
+    { "2026-10-18T07:00:00Z", 1792306800 },
+    { "2026-10-18t07:00:00z", 1792306800 },
+    { "2026-10-18T07:00:00.250Z", 1792306800 },
+    { "2026-10-18T09:00:00+02:00", 1792306800 },
+    { "2026-10-18T09:00:00+0200", 1792306800 },
+    { "2026-10-18T00:00:00-07:00", 1792306800 },
+    { "2026-10-18T00:00:00-0700", 1792306800 },
+    { "2026-10-18T07:00:00+00:00", 1792306800 },
+    { "2026-10-18T07:00:00-00:00", 1792306800 },
+    { "2026-06-01T12:00:00-03:30", 1780327800 },
+    { "2027-01-01T00:15:00+05:45", 1798741800 },
+    { "1969-12-31T23:59:59Z", -1 },
+  };
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+    int64_t time = 0;
+    CHECK(ParseTime(cases[i].value, false, &time) && time == cases[i].time, "%s: got %lld, expected %lld",
+        cases[i].value, (long long) time, (long long) cases[i].time);
+  }
+}
+
+// Dec 31 -> Jan 1 (also when only the offset crosses it) and Feb 29, against date(1)
+static void TestParseEventTimeCalendar(void) {
+  struct {
+    const char *value;
+    int64_t time;
+  } cases[] = {
+    { "2026-12-31T23:59:59Z", 1798761599 },
+    { "2027-01-01T00:00:00Z", 1798761600 },
+    { "2026-12-31T23:30:00-01:00", 1798763400 },
+    { "2027-01-01T00:30:00+01:00", 1798759800 },
+    { "2024-02-29T23:59:59Z", 1709251199 },
+    { "2024-03-01T00:00:00Z", 1709251200 },
+    { "2000-02-29T00:00:00Z", 951782400 },
+    { "2100-03-01T00:00:00Z", 4107542400LL },
+  };
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+    int64_t time = 0;
+    CHECK(ParseTime(cases[i].value, false, &time) && time == cases[i].time, "%s: got %lld, expected %lld",
+        cases[i].value, (long long) time, (long long) cases[i].time);
+  }
+  const char *invalid[] = { "2025-02-29T00:00:00Z", "2100-02-29T00:00:00Z", "2026-04-31T00:00:00Z",
+    "2026-12-32T00:00:00Z", "2026-13-01T00:00:00Z", "2026-00-10T00:00:00Z" };
+  for (size_t i = 0; i < sizeof invalid / sizeof invalid[0]; i++) {
+    int64_t time;
+    CHECK(!ParseTime(invalid[i], false, &time), "%s was accepted", invalid[i]);
+  }
+}
+
+static void TestParseEventTimeRejects(void) {
+  const char *invalid[] = { "", "2026-10-18", "2026-10-18T09:00:00", "2026-10-18T09:00Z",
+    "2026-10-18T24:00:00Z", "2026-10-18T09:60:00Z", "2026-10-18T09:00:00+2:00", "2026-10-18T09:00:00+02:0",
+    "2026-10-18T09:00:00+24:00", "2026-10-18T09:00:00.Z", "2026-10-18T09:00:00Zx", "2026-1-18T09:00:00Z",
+    "2026-10-18X09:00:00Z", "abcd-10-18T09:00:00Z", " 2026-10-18T09:00:00Z" };
+  for (size_t i = 0; i < sizeof invalid / sizeof invalid[0]; i++) {
+    int64_t time;
+    CHECK(!ParseTime(invalid[i], false, &time), "\"%s\" was accepted", invalid[i]);
+  }
+  const char *invalid_dates[] = { "", "2026-10-1", "2026-10-18x", "2026-02-30", "2026-10-18T00:00:00Z" };
+  for (size_t i = 0; i < sizeof invalid_dates / sizeof invalid_dates[0]; i++) {
+    int64_t time;
+    CHECK(!ParseTime(invalid_dates[i], true, &time), "date \"%s\" was accepted", invalid_dates[i]);
+  }
+  // Every prefix of a valid time, in a buffer of exactly that size (so reading past it shows
+  // up under a sanitizer)
+  const char *valid = "2026-10-18T09:00:00.5+02:00";
+  for (size_t length = 0; length < strlen(valid); length++) {
+    std::vector<char> prefix(valid, valid + length);
+    int64_t time;
+    CHECK(!ParseEventTime(prefix.data(), length, false, &time), "prefix of %zu bytes was accepted", length);
+  }
+}
+
+// Random times in years 1900-2199 with every quarter-hour offset, against strptime
+static void TestParseEventTimeRandom(void) {
+  for (int i = 0; i < 100000; i++) {
+    char value[40];
+    snprintf(value, sizeof value, "%04d-%02d-%02dT%02d:%02d:%02d%c%02d:%02d", 1900 + rand() % 300,
+        1 + rand() % 12, 1 + rand() % 28, rand() % 24, rand() % 60, rand() % 60, rand() % 2 ? '+' : '-',
+        rand() % 15, rand() % 4 * 15);
+    int64_t time = 0;
+    int64_t expected = 0;
+    ParseEventTimeStrptime(value, strlen(value), false, &expected);
+    CHECK(ParseTime(value, false, &time) && time == expected, "%s: got %lld, strptime %lld", value,
+        (long long) time, (long long) expected);
+  }
+}
+
+// All day dates are local midnight: every day of 2017-2027 against mktime, which covers each
+// DST change and year end in the zone
+static void CheckDatesAgainstMktime(void) {
+  for (int year = 2017; year <= 2027; year++) {
+    for (int month = 1; month <= 12; month++) {
+      for (int day = 1; day <= 31; day++) {
+        char value[16];
+        snprintf(value, sizeof value, "%04d-%02d-%02d", year, month, day);
+        int64_t time = 0;
+        int64_t expected = 0;
+        bool valid = ParseTime(value, true, &time);
+        if (!ParseEventTimeStrptime(value, strlen(value), true, &expected) || !valid) {
+          // strptime takes e.g. Feb 30 (and mktime moves it on): only check the rejections
+          CHECK(valid || day > 28, "%s was rejected", value);
+          continue;
+        }
+        CHECK(time == expected, "%s: got %lld, mktime %lld", value, (long long) time, (long long) expected);
+      }
+    }
+  }
+}
+
+// The days DST starts and ends in Berlin are 23 and 25 hours long, and New Year is 24
+static void CheckBerlinDays(void) {
+  struct {
+    const char *value;
+    int64_t time;
+  } cases[] = {
+    { "2026-03-28", 1774652400 },
+    { "2026-03-29", 1774738800 },
+    { "2026-03-30", 1774821600 },
+    { "2026-10-25", 1792879200 },
+    { "2026-10-26", 1792969200 },
+    { "2026-12-31", 1798671600 },
+    { "2027-01-01", 1798758000 },
+  };
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+    int64_t time = 0;
+    CHECK(ParseTime(cases[i].value, true, &time) && time == cases[i].time, "%s: got %lld, expected %lld",
+        cases[i].value, (long long) time, (long long) cases[i].time);
+  }
+}
+
+// Lord Howe Island moves its clocks by half an hour: DST starts on a 23.5 hour day
+static void CheckLordHoweDays(void) {
+  int64_t start = 0;
+  int64_t next = 0;
+  CHECK(ParseTime("2026-10-04", true, &start) && start == 1791034200, "2026-10-04: got %lld", (long long) start);
+  CHECK(ParseTime("2026-10-05", true, &next) && next == 1791118800, "2026-10-05: got %lld", (long long) next);
+}
+
+static void TestParseEventDatesAcrossDst(void) {
+  const char *zones[] = { "Europe/Berlin", "America/New_York", "Australia/Lord_Howe", "America/Sao_Paulo",
+    "Asia/Kolkata", "UTC" };
+  for (size_t z = 0; z < sizeof zones / sizeof zones[0]; z++) {
+    InZone(zones[z], CheckDatesAgainstMktime);
+  }
+  InZone("Europe/Berlin", CheckBerlinDays);
+  InZone("Australia/Lord_Howe", CheckLordHoweDays);
+}
+
+// The fixtures are one busy day's event list, as Google sends it in full and with the fields=
+// projection gcal.cpp asks for (EVENT_LIST_FIELDS): everything an Event holds has to survive it
+static void TestEventListFieldsKeepEvents(void) {
+  std::string full = ReadFixture("events_full.json");
+  std::string projected = ReadFixture("events_fields.json");
+  EventPage full_page;
+  EventPage projected_page;
+  CHECK(ParseEventPage(full.data(), full.size(), full_page), "events_full.json didn't parse");
+  CHECK(ParseEventPage(projected.data(), projected.size(), projected_page), "events_fields.json didn't parse");
+  CHECK(!full_page.items.events.empty(), "events_full.json has no events");
+  CHECK(projected_page.items.Same(full_page.items), "the projection lost something an Event holds");
+  CHECK(projected_page.next_sync_token == full_page.next_sync_token, "the projection lost the sync token");
+}
+
+struct Test {
+  const char *name;
+  void (*run)(void);
+};
+
+static const Test tests[] = {
+  { "DiffFrames matches the byte loop on random frames", TestDiffFramesRandom },
+  { "DiffFrames splits spans at exactly gap_bytes", TestDiffFramesGapBoundary },
+  { "DiffFrames handles unaligned row tails", TestDiffFramesTail },
+  { "ConvertCairoA1ToPanel paths match the bitwise reference", TestConvertCairoA1ToPanel },
+  { "ConvertCairoA1ToPanel converts a whole frame", TestConvertCairoA1ToPanelFrame },
+  { "ParseEventTime reads Z, +hh:mm and +hhmm offsets", TestParseEventTimeOffsets },
+  { "ParseEventTime handles year ends and leap days", TestParseEventTimeCalendar },
+  { "ParseEventTime rejects malformed times and dates", TestParseEventTimeRejects },
+  { "ParseEventTime matches strptime on random times", TestParseEventTimeRandom },
+  { "ParseEventTime puts dates at local midnight across DST changes", TestParseEventDatesAcrossDst },
+  { "The event list projection keeps everything an Event holds", TestEventListFieldsKeepEvents },
+};
+
+int main(void) {
+  srand(1);
+  for (size_t t = 0; t < sizeof tests / sizeof tests[0]; t++) {
+    int before = failures;
+    tests[t].run();
+    printf("%s %s\n", failures == before ? "ok  " : "FAIL", tests[t].name);
+  }
+  printf("%d failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}